@@ -0,0 +1,409 @@
+// Link layer throughput benchmark.
+// Runs a transmitter and a receiver in one process, each on its own pty, with a paced copy between the two
+// standing in for the cable. Sweeps payload size, simulated frame error rate, baud rate and timeout and prints
+// one row per run with throughput, efficiency (throughput over baud rate) and CPU time per byte of each end.
+
+#define _GNU_SOURCE
+#include "link_layer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_POINTS 16 // values per swept setting
+#define BITS_PER_BYTE 10 // 8N1: start, 8 data and stop bit
+#define SLICE_MICROS 1000 // line time the cable passes on at once, so frames arrive as they come off the line
+#define POINT_SECONDS 1 // line time a run is sized for when the byte count is not given
+#define MIN_PACKETS 16
+#define UNPACED_BYTES (1024 * 1024) // bytes per run without baud pacing
+#define RUN_LIMIT 120 // seconds before a stuck run aborts the benchmark
+#define N_TRIES 3
+
+extern int SIM_ERROR;
+extern int ERROR_RATE;
+
+typedef struct
+{
+    int values[MAX_POINTS];
+    int count;
+} Sweep;
+
+// One direction of the simulated cable: bytes from one pty master go to the other no faster than baud allows.
+typedef struct
+{
+    int from;
+    int to;
+    int baud; // 0 for no pacing
+    volatile int stop;
+    pthread_t thread;
+} CableDirection;
+
+typedef struct
+{
+    char txPort[64];
+    char rxPort[64];
+    int baud;
+    int timeout;
+    int payload;
+    long bytes;
+
+    pthread_mutex_t lock;
+    LinkConnection* rxConn; // while the receiver reads, so a failed transmitter can wake it
+    int txFailed;
+    int rxFailed;
+    long long txCpu; // ns
+    long long rxCpu;
+    long long startedAt; // us, from the first packet written
+    long long finishedAt; // us, last packet received
+} Run;
+
+long long threadCpuNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Termios speed for a baud rate, the ptys ignore it but openConnection sets it.
+int baudConstant(int baud) {
+    switch(baud) {
+        case 1200: return B1200;
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        default: return B38400;
+    }
+}
+
+// Parses a comma separated list of integers into sweep.
+// Return "0" on success or "-1" on error.
+int parseSweep(const char* list, Sweep* sweep) {
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", list);
+    sweep->count = 0;
+    char* save = NULL;
+    for(char* value = strtok_r(copy, ",", &save); value != NULL; value = strtok_r(NULL, ",", &save)) {
+        char* end;
+        long parsed = strtol(value, &end, 10);
+        if(*end != '\0' || parsed < 0 || sweep->count == MAX_POINTS) return -1;
+        sweep->values[sweep->count++] = parsed;
+    }
+    return sweep->count > 0 ? 0 : -1;
+}
+
+// Opens a pty master and returns its slave's name in port.
+// Return the master fd, or "-1" on error.
+int openPty(char* port, int size) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(master < 0 || grantpt(master) != 0 || unlockpt(master) != 0 || ptsname_r(master, port, size) != 0) {
+        perror("pty");
+        if(master >= 0) close(master);
+        return -1;
+    }
+    // raw, so the master passes bytes through untouched
+    struct termios raw;
+    tcgetattr(master, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(master, TCSANOW, &raw);
+    return master;
+}
+
+void* cableDirection(void* arg) {
+    CableDirection* direction = arg;
+    unsigned char buf[4096];
+    long long lineFree = 0; // us, when the bytes passed on so far have left the line
+    // bytes the line carries in a slice, the rest waits in the pty until the line is free
+    int slice = direction->baud > 0 ? (long long)direction->baud * SLICE_MICROS / BITS_PER_BYTE / 1000000 : sizeof(buf);
+    if(slice < 1) slice = 1;
+    if(slice > (int)sizeof(buf)) slice = sizeof(buf);
+
+    struct pollfd fds = {direction->from, POLLIN, 0};
+    while(!direction->stop) {
+        if(poll(&fds, 1, 50) <= 0) continue;
+        int bytes = read(direction->from, buf, slice);
+        if(bytes <= 0) {
+            // the slave is not open (yet or anymore)
+            struct timespec pause = {0, 1000000};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        if(direction->baud > 0) {
+            long long now = nowMicros();
+            // a line that was busy keeps its pace, the time to pass the last slice on is not lost
+            if(lineFree < now - SLICE_MICROS) lineFree = now;
+            lineFree += (long long)bytes * BITS_PER_BYTE * 1000000 / direction->baud;
+            long long wait = lineFree - now;
+            if(wait > 0) {
+                struct timespec pause = {wait / 1000000, (wait % 1000000) * 1000};
+                nanosleep(&pause, NULL);
+            }
+        }
+        for(int written = 0; written < bytes;) {
+            int n = write(direction->to, buf + written, bytes - written);
+            if(n < 0 && errno != EAGAIN && errno != EINTR) break;
+            if(n > 0) written += n;
+        }
+    }
+    return NULL;
+}
+
+// Content of byte index of packet number, checked by the receiver.
+unsigned char patternByte(long packet, int index) {
+    return (packet * 131 + index * 7) & 0xFF;
+}
+
+void* transmitter(void* arg) {
+    Run* run = arg;
+    long long cpuStart = threadCpuNanos();
+    LinkLayer parameters;
+    strcpy(parameters.serialPort, run->txPort);
+    parameters.role = LlTx;
+    parameters.baudRate = baudConstant(run->baud);
+    parameters.nRetransmissions = N_TRIES;
+    parameters.timeout = run->timeout;
+
+    LinkConnection* conn = llconnect(parameters);
+    if(conn == NULL) {
+        run->txFailed = TRUE;
+    } else {
+        unsigned char packet[MAX_PAYLOAD_SIZE];
+        run->startedAt = nowMicros();
+        long sent = 0;
+        for(long number = 0; sent < run->bytes; number++) {
+            int size = run->bytes - sent < run->payload ? run->bytes - sent : run->payload;
+            for(int i = 0; i < size; i++) packet[i] = patternByte(number, i);
+            if(llwriteOn(conn, packet, size) < size) break;
+            sent += size;
+        }
+        if(sent < run->bytes || llflushOn(conn) == -1) {
+            run->txFailed = TRUE;
+            llabandon(conn);
+        } else if(lldisconnect(conn, FALSE) != 0) {
+            run->txFailed = TRUE;
+        }
+    }
+    run->txCpu = threadCpuNanos() - cpuStart;
+
+    if(run->txFailed) {
+        pthread_mutex_lock(&run->lock);
+        if(run->rxConn != NULL) llinterrupt(run->rxConn);
+        pthread_mutex_unlock(&run->lock);
+    }
+    return NULL;
+}
+
+void* receiver(void* arg) {
+    Run* run = arg;
+    long long cpuStart = threadCpuNanos();
+    LinkLayer parameters;
+    strcpy(parameters.serialPort, run->rxPort);
+    parameters.role = LlRx;
+    parameters.baudRate = baudConstant(run->baud);
+    parameters.nRetransmissions = N_TRIES;
+    parameters.timeout = run->timeout;
+
+    LinkConnection* conn = llconnect(parameters);
+    if(conn == NULL) {
+        run->rxFailed = TRUE;
+        run->rxCpu = threadCpuNanos() - cpuStart;
+        return NULL;
+    }
+    pthread_mutex_lock(&run->lock);
+    run->rxConn = conn;
+    int failed = run->txFailed;
+    pthread_mutex_unlock(&run->lock);
+
+    unsigned char packet[MAX_PAYLOAD_SIZE + MAX_FCS_SIZE];
+    long received = 0;
+    for(long number = 0; !failed && received < run->bytes; number++) {
+        int expected = run->bytes - received < run->payload ? run->bytes - received : run->payload;
+        int size = llreadOn(conn, packet);
+        if(size == 0) {
+            // woken by a transmitter that gave up
+            number--;
+            pthread_mutex_lock(&run->lock);
+            failed = run->txFailed;
+            pthread_mutex_unlock(&run->lock);
+            continue;
+        }
+        if(size != expected) {
+            printf("Packet %ld has %d bytes instead of %d\n", number, size, expected);
+            failed = TRUE;
+            break;
+        }
+        for(int i = 0; i < size; i++) {
+            if(packet[i] != patternByte(number, i)) {
+                printf("Packet %ld differs at byte %d\n", number, i);
+                failed = TRUE;
+                break;
+            }
+        }
+        received += size;
+    }
+    run->finishedAt = nowMicros();
+
+    pthread_mutex_lock(&run->lock);
+    run->rxConn = NULL;
+    pthread_mutex_unlock(&run->lock);
+    if(failed) {
+        run->rxFailed = TRUE;
+        llabandon(conn);
+    } else if(lldisconnect(conn, FALSE) != 0) {
+        run->rxFailed = TRUE;
+    }
+    run->rxCpu = threadCpuNanos() - cpuStart;
+    return NULL;
+}
+
+// Waits for thread until deadline (us), aborting the benchmark if it is stuck.
+void joinBefore(pthread_t thread, long long deadline) {
+    struct timespec limit;
+    clock_gettime(CLOCK_REALTIME, &limit);
+    limit.tv_sec += (deadline - nowMicros()) / 1000000 + 1;
+    if(pthread_timedjoin_np(thread, NULL, &limit) != 0) {
+        printf("Run stuck for more than %d seconds, giving up\n", RUN_LIMIT);
+        exit(1);
+    }
+}
+
+// Runs one transfer over a fresh pair of ptys.
+// Return "0" on success or "-1" on error.
+int runOnce(Run* run) {
+    int txMaster = openPty(run->txPort, sizeof(run->txPort));
+    int rxMaster = openPty(run->rxPort, sizeof(run->rxPort));
+    if(txMaster < 0 || rxMaster < 0) return -1;
+
+    CableDirection toRx = {txMaster, rxMaster, run->baud, FALSE};
+    CableDirection toTx = {rxMaster, txMaster, run->baud, FALSE};
+    pthread_create(&toRx.thread, NULL, cableDirection, &toRx);
+    pthread_create(&toTx.thread, NULL, cableDirection, &toTx);
+
+    pthread_mutex_init(&run->lock, NULL);
+    run->rxConn = NULL;
+    run->txFailed = FALSE;
+    run->rxFailed = FALSE;
+    long long deadline = nowMicros() + (long long)RUN_LIMIT * 1000000;
+    pthread_t tx, rx;
+    pthread_create(&rx, NULL, receiver, run);
+    pthread_create(&tx, NULL, transmitter, run);
+    joinBefore(tx, deadline);
+    joinBefore(rx, deadline);
+    pthread_mutex_destroy(&run->lock);
+
+    toRx.stop = TRUE;
+    toTx.stop = TRUE;
+    pthread_join(toRx.thread, NULL);
+    pthread_join(toTx.thread, NULL);
+    close(txMaster);
+    close(rxMaster);
+    return run->txFailed || run->rxFailed ? -1 : 0;
+}
+
+void usage(const char* program) {
+    printf("Usage: %s [-p payloads] [-e error rates] [-b bauds] [-t timeouts] [-r repeats] [-n bytes] [-j]\n"
+           "  lists are comma separated, error rates in %% of I-frames, baud 0 for an unpaced line\n"
+           "  -n bytes per run, by default one second of line time (1 MiB unpaced)\n"
+           "  -j prints JSON instead of CSV\n", program);
+}
+
+int main(int argc, char *argv[]) {
+    Sweep payloads, errorRates, bauds, timeouts;
+    parseSweep("128,512,1000", &payloads);
+    parseSweep("0,5,10", &errorRates);
+    parseSweep("38400,115200,0", &bauds);
+    parseSweep("1", &timeouts);
+    int repeats = 3;
+    long bytes = 0;
+    int json = FALSE;
+
+    int option;
+    while((option = getopt(argc, argv, "p:e:b:t:r:n:jh")) != -1) {
+        int valid = TRUE;
+        switch(option) {
+            case 'p': valid = parseSweep(optarg, &payloads) == 0; break;
+            case 'e': valid = parseSweep(optarg, &errorRates) == 0; break;
+            case 'b': valid = parseSweep(optarg, &bauds) == 0; break;
+            case 't': valid = parseSweep(optarg, &timeouts) == 0; break;
+            case 'r': repeats = atoi(optarg); valid = repeats > 0; break;
+            case 'n': bytes = atol(optarg); valid = bytes > 0; break;
+            case 'j': json = TRUE; break;
+            default: valid = FALSE; break;
+        }
+        if(!valid) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    for(int i = 0; i < payloads.count; i++) {
+        if(payloads.values[i] < 1 || payloads.values[i] > MAX_PAYLOAD_SIZE) {
+            printf("Payload sizes go from 1 to %d\n", MAX_PAYLOAD_SIZE);
+            return 1;
+        }
+    }
+    for(int i = 0; i < timeouts.count; i++) {
+        if(timeouts.values[i] < 1) {
+            printf("Timeouts are at least 1 second\n");
+            return 1;
+        }
+    }
+
+    const char* columns[] = {"payload", "error_rate", "baud", "timeout", "run", "ok", "bytes", "seconds",
+                             "throughput_bps", "efficiency", "tx_cpu_ns_per_byte", "rx_cpu_ns_per_byte"};
+    int nColumns = sizeof(columns) / sizeof(columns[0]);
+    if(json) {
+        printf("[");
+    } else {
+        for(int i = 0; i < nColumns; i++) printf("%s%s", columns[i], i + 1 < nColumns ? "," : "\n");
+    }
+    fflush(stdout);
+
+    int nRows = 0;
+    int nFailed = 0;
+    for(int p = 0; p < payloads.count; p++)
+    for(int e = 0; e < errorRates.count; e++)
+    for(int b = 0; b < bauds.count; b++)
+    for(int t = 0; t < timeouts.count; t++)
+    for(int r = 1; r <= repeats; r++) {
+        Run run;
+        memset(&run, 0, sizeof(run));
+        run.payload = payloads.values[p];
+        run.baud = bauds.values[b];
+        run.timeout = timeouts.values[t];
+        run.bytes = bytes;
+        if(run.bytes == 0) run.bytes = run.baud > 0 ? (long)run.baud / BITS_PER_BYTE * POINT_SECONDS : UNPACED_BYTES;
+        if(run.bytes < (long)MIN_PACKETS * run.payload) run.bytes = (long)MIN_PACKETS * run.payload;
+        SIM_ERROR = errorRates.values[e] > 0;
+        ERROR_RATE = errorRates.values[e];
+
+        int ok = runOnce(&run) == 0;
+        if(!ok) nFailed++;
+        double seconds = (run.finishedAt - run.startedAt) / 1e6;
+        double throughput = ok && seconds > 0 ? run.bytes * 8 / seconds : 0;
+        double values[] = {run.payload, errorRates.values[e], run.baud, run.timeout, r, ok, run.bytes, seconds,
+                           throughput, run.baud > 0 ? throughput / run.baud : 0,
+                           (double)run.txCpu / run.bytes, (double)run.rxCpu / run.bytes};
+
+        if(json) printf("%s\n  {", nRows > 0 ? "," : "");
+        for(int i = 0; i < nColumns; i++) {
+            const char* format = i == 7 || i == 9 ? "%.4f" : i > 9 ? "%.1f" : "%.0f";
+            if(json) printf("\"%s\": ", columns[i]);
+            printf(format, values[i]);
+            if(i + 1 < nColumns) printf(json ? ", " : ",");
+        }
+        printf(json ? "}" : "\n");
+        fflush(stdout);
+        nRows++;
+    }
+    if(json) printf("\n]\n");
+    return nFailed > 0 ? 1 : 0;
+}
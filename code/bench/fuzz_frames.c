@@ -0,0 +1,378 @@
+// Random input harness for the receive state machines.
+// Feeds generated byte streams, from plain noise to valid frames with bytes flipped, dropped or repeated,
+// through llreadOn and through parseFrame for every act, under several ARQ, FCS and FEC settings, and checks:
+//  - nothing is written past the packet llreadOn is given or past the 7 bytes parseFrame may use,
+//  - llreadOn never hands over more than MAX_PAYLOAD_SIZE bytes and stops at the end of the input,
+//  - valid frames after any garbage all come out, in order and unchanged (resynchronization).
+// Standalone it runs a number of seeded iterations and writes a failing input to FAILED_INPUT, which -f replays.
+// Built with -DLIBFUZZER it is a libFuzzer target instead, the first input byte picking the settings.
+
+#include "link_layer.h"
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N_ITERATIONS 20000
+#define MAX_INPUT (4 * MAX_FRAME_SIZE)
+#define MAX_FRAMES 8 // valid frames in one generated input
+#define GARBAGE_BYTES 64 // most garbage ahead of a frame in the resynchronization check
+#define CANARY_BYTES 64
+#define CANARY 0xA5
+#define PACKET_SIZE (MAX_PAYLOAD_SIZE + MAX_FCS_SIZE) // what llread asks of its callers
+#define RECEIVED_SIZE 7 // F A C BCC parameter BCC2 F
+#define FAILED_INPUT "fuzz-failed.bin"
+
+#define FLAG_BYTE 0x7E
+#define ESC_BYTE 0x7D
+
+extern FcsMode FCS_MODE;
+extern int FEC_STRENGTH;
+extern ArqMode ARQ_MODE;
+extern int WINDOW_SIZE;
+extern int ERASURE_DATA;
+extern int ERASURE_PARITY;
+
+typedef struct
+{
+    const char* name;
+    ArqMode arqMode;
+    int windowSize;
+    FcsMode fcsMode;
+    int fecStrength;
+    int erasureData;
+    int erasureParity;
+} Settings;
+
+Settings settings[] = {
+    {"stop-and-wait bcc", ARQ_STOP_AND_WAIT, 1, FCS_BCC, 0, 0, 0},
+    {"go-back-n crc16", ARQ_GO_BACK_N, 7, FCS_CRC16, 0, 0, 0},
+    {"go-back-n crc32", ARQ_GO_BACK_N, 7, FCS_CRC32, 0, 0, 0},
+    {"go-back-n crc32 fec", ARQ_GO_BACK_N, 7, FCS_CRC32, 4, 0, 0},
+    {"go-back-n crc32 erasure", ARQ_GO_BACK_N, 7, FCS_CRC32, 0, 4, 1},
+    {"selective-repeat crc32", ARQ_SELECTIVE_REPEAT, 8, FCS_CRC32, 0, 0, 0},
+    {"selective-repeat crc32 fec erasure", ARQ_SELECTIVE_REPEAT, 8, FCS_CRC32, 2, 4, 2},
+};
+#define N_SETTINGS ((int)(sizeof(settings) / sizeof(settings[0])))
+
+Action acts[] = {RCV_SET, RCV_UA, WRITE, READ, CLOSETX, CLOSERX};
+#define N_ACTS ((int)(sizeof(acts) / sizeof(acts[0])))
+
+void applySettings(const Settings* s) {
+    ARQ_MODE = s->arqMode;
+    WINDOW_SIZE = s->windowSize;
+    FCS_MODE = s->fcsMode;
+    FEC_STRENGTH = s->fecStrength;
+    ERASURE_DATA = s->erasureData;
+    ERASURE_PARITY = s->erasureParity > 0 ? s->erasureParity : 1;
+}
+
+int canaryIntact(const unsigned char* canary) {
+    for(int i = 0; i < CANARY_BYTES; i++) {
+        if(canary[i] != CANARY) return FALSE;
+    }
+    return TRUE;
+}
+
+// Reads input through llreadOn to the end, into a packet of exactly the size llread asks for.
+// Return NULL if every check held, or what went wrong.
+const char* checkRead(const unsigned char* input, long size) {
+    LinkConnection* conn = llconnectMemory(LlRx, input, size, -1);
+    if(conn == NULL) return "no memory connection";
+    unsigned char buffer[PACKET_SIZE + CANARY_BYTES];
+    memset(buffer, CANARY, sizeof(buffer));
+    const char* failure = NULL;
+    // every packet takes at least one byte of input, or comes out of the frames buffered before it
+    long limit = size + 2 * MAX_PAYLOAD_SIZE;
+    int bytes;
+    for(long calls = 0; failure == NULL && (bytes = llreadOn(conn, buffer)) != 0; calls++) {
+        if(bytes < 0) failure = "llread failed";
+        else if(bytes > MAX_PAYLOAD_SIZE) failure = "llread packet longer than MAX_PAYLOAD_SIZE";
+        else if(calls > limit) failure = "llread does not stop at the end of the input";
+    }
+    if(failure == NULL && !canaryIntact(buffer + PACKET_SIZE)) failure = "llread wrote past the packet";
+    llabandon(conn);
+    return failure;
+}
+
+// Reads input through parseFrame with act, starting over after every frame.
+// Return NULL if every check held, or what went wrong.
+const char* checkParse(const unsigned char* input, long size, Action act) {
+    LinkConnection* conn = llconnectMemory(act == WRITE || act == RCV_UA || act == CLOSETX ? LlTx : LlRx,
+                                           input, size, -1);
+    if(conn == NULL) return "no memory connection";
+    unsigned char received[RECEIVED_SIZE + CANARY_BYTES];
+    memset(received, CANARY, sizeof(received));
+    const char* failure = NULL;
+    State state = START;
+    int index = 0;
+    for(long i = 0; failure == NULL && i < size; i++) {
+        int stop = parseFrame(conn, act, &state, received, &index);
+        if(index < 0 || index > RECEIVED_SIZE) {
+            failure = "parseFrame index out of bounds";
+        } else if(stop) {
+            // an I-frame header is all parseFrame keeps of one while waiting for acknowledgements
+            if(index < 4 || received[0] != FLAG_BYTE || (index > 4 && received[index - 1] != FLAG_BYTE)) {
+                failure = "parseFrame stopped on a malformed frame";
+            }
+            state = START;
+            index = 0;
+        }
+    }
+    if(failure == NULL && !canaryIntact(received + RECEIVED_SIZE)) failure = "parseFrame wrote past received";
+    llabandon(conn);
+    return failure;
+}
+
+// Every check on one input under the settings in use.
+// Return NULL if every check held, or what went wrong.
+const char* checkInput(const unsigned char* input, long size) {
+    const char* failure = checkRead(input, size);
+    for(int i = 0; failure == NULL && i < N_ACTS; i++) failure = checkParse(input, size, acts[i]);
+    return failure;
+}
+
+// Appends frame number ns with a random payload of 1 to MAX_PAYLOAD_SIZE bytes to input, stuffed by encoder.
+// payload gets the unstuffed bytes and their count.
+// Return number of bytes appended, or "0" if they do not fit in room.
+int appendFrame(LinkConnection* encoder, int ns, unsigned char* input, long room, unsigned char* payload,
+                int* payloadSize, unsigned int* seed) {
+    EncodedFrame frame;
+    *payloadSize = 1 + rand_r(seed) % MAX_PAYLOAD_SIZE;
+    // short payloads now and then, and bytes that need stuffing in a good share of them
+    if(rand_r(seed) % 2 == 0) *payloadSize = 1 + *payloadSize % 16;
+    int special = rand_r(seed) % 4;
+    for(int i = 0; i < *payloadSize; i++) {
+        payload[i] = special > 0 && rand_r(seed) % 4 == 0 ? (rand_r(seed) % 2 ? FLAG_BYTE : ESC_BYTE) : rand_r(seed);
+    }
+    if(llencodeOn(encoder, payload, *payloadSize, NULL, 0, &frame) != 0) return 0;
+    llnumberFrame(&frame, ns);
+    if(frame.size > room) return 0;
+    memcpy(input, frame.data, frame.size);
+    return frame.size;
+}
+
+// Builds a random input of at most MAX_INPUT bytes in input: noise, a frame header followed by more body than any
+// frame may have, or a few valid frames with random damage.
+// Return its size.
+long generateInput(unsigned char* input, unsigned int* seed) {
+    long size = 0;
+    switch(rand_r(seed) % 4) {
+        case 0:
+            // noise, flags and escapes mixed in
+            size = rand_r(seed) % MAX_INPUT;
+            for(long i = 0; i < size; i++) {
+                int pick = rand_r(seed) % 8;
+                input[i] = pick == 0 ? FLAG_BYTE : pick == 1 ? ESC_BYTE : rand_r(seed);
+            }
+            return size;
+        case 1: {
+            // an overlong body, ending in an escape or a flag or neither
+            // windowed I-frame control, or the stop-and-wait one
+            unsigned char control = rand_r(seed) % 2 ? 0x10 | (rand_r(seed) % 16) : (rand_r(seed) % 2) << 6;
+            unsigned char header[] = {FLAG_BYTE, 0x03, control, 0x03 ^ control};
+            memcpy(input, header, sizeof(header));
+            size = sizeof(header) + rand_r(seed) % (MAX_INPUT - sizeof(header) - 1);
+            for(long i = sizeof(header); i < size; i++) {
+                do input[i] = rand_r(seed); while(input[i] == FLAG_BYTE);
+            }
+            int end = rand_r(seed) % 3;
+            if(end < 2) input[size++] = end == 0 ? FLAG_BYTE : ESC_BYTE;
+            return size;
+        }
+        default: {
+            LinkConnection* encoder = llconnectMemory(LlTx, NULL, 0, -1);
+            if(encoder == NULL) return 0;
+            unsigned char payload[MAX_PAYLOAD_SIZE];
+            int payloadSize;
+            int frames = 1 + rand_r(seed) % MAX_FRAMES;
+            int ns = rand_r(seed) % 16;
+            for(int i = 0; i < frames; i++) {
+                // mostly in order, sometimes a frame repeated or skipped
+                int pick = rand_r(seed) % 8;
+                int bytes = appendFrame(encoder, pick == 0 ? ns - 1 : pick == 1 ? ns + 1 : ns, input + size,
+                                        MAX_INPUT - size, payload, &payloadSize, seed);
+                if(bytes == 0) break;
+                size += bytes;
+                if(pick > 1) ns++;
+            }
+            llabandon(encoder);
+            int damage = rand_r(seed) % 8;
+            for(int i = 0; i < damage && size > 1; i++) {
+                long at = rand_r(seed) % size;
+                long span = 1 + rand_r(seed) % (size - at < 32 ? size - at : 32);
+                switch(rand_r(seed) % 4) {
+                    case 0:
+                        input[at] ^= 1 << (rand_r(seed) % 8);
+                        break;
+                    case 1:
+                        // cut span bytes out
+                        memmove(input + at, input + at + span, size - at - span);
+                        size -= span;
+                        break;
+                    case 2:
+                        // say span bytes twice
+                        if(size + span > MAX_INPUT) break;
+                        memmove(input + at + span, input + at, size - at);
+                        size += span;
+                        break;
+                    default:
+                        input[at] = rand_r(seed) % 2 ? FLAG_BYTE : ESC_BYTE;
+                        break;
+                }
+            }
+            return size;
+        }
+    }
+}
+
+// Random garbage, and frames cut short, ahead of each of a few valid frames: every frame must come out of llreadOn,
+// in order.
+// Only run with a CRC32, under which garbage passing for a valid frame is not a concern.
+// input gets what was fed and its size.
+// Return NULL if every check held, or what went wrong.
+const char* checkResync(unsigned char* input, long* size, unsigned int* seed) {
+    unsigned char payloads[MAX_FRAMES][MAX_PAYLOAD_SIZE];
+    int payloadSizes[MAX_FRAMES];
+    LinkConnection* encoder = llconnectMemory(LlTx, NULL, 0, -1);
+    if(encoder == NULL) return "no memory connection";
+    int frames = 0;
+    *size = 0;
+    for(int i = 0; i < MAX_FRAMES; i++) {
+        int garbage = rand_r(seed) % (GARBAGE_BYTES + 1);
+        if(*size + garbage > MAX_INPUT) break;
+        for(int j = 0; j < garbage; j++) input[(*size)++] = rand_r(seed);
+        // half the time the garbage ends in a frame cut short, right after an escape when it has one
+        if(rand_r(seed) % 2 == 0) {
+            unsigned char scratch[MAX_PAYLOAD_SIZE];
+            int scratchSize;
+            int bytes = appendFrame(encoder, i, input + *size, MAX_INPUT - *size, scratch, &scratchSize, seed);
+            if(bytes == 0) break;
+            int cut = 1 + rand_r(seed) % (bytes - 2);
+            for(int j = cut; j < bytes - 2 && rand_r(seed) % 2 == 0; j++) {
+                if(input[*size + j] == ESC_BYTE) {
+                    cut = j + 1;
+                    break;
+                }
+            }
+            *size += cut;
+        }
+        int bytes = appendFrame(encoder, i, input + *size, MAX_INPUT - *size, payloads[i], &payloadSizes[i], seed);
+        if(bytes == 0) break;
+        *size += bytes;
+        frames++;
+    }
+    llabandon(encoder);
+
+    LinkConnection* conn = llconnectMemory(LlRx, input, *size, -1);
+    if(conn == NULL) return "no memory connection";
+    unsigned char packet[PACKET_SIZE];
+    const char* failure = NULL;
+    int received = 0;
+    int bytes;
+    while(failure == NULL && (bytes = llreadOn(conn, packet)) > 0) {
+        if(received == frames) failure = "llread took a frame from the garbage";
+        else if(bytes != payloadSizes[received] || memcmp(packet, payloads[received], bytes) != 0) {
+            failure = "llread packet differs from the frame sent";
+        }
+        received++;
+    }
+    if(failure == NULL && bytes < 0) failure = "llread failed";
+    if(failure == NULL && received < frames) failure = "llread lost a frame after garbage";
+    llabandon(conn);
+    return failure;
+}
+
+void reportFailure(const char* failure, const Settings* s, const unsigned char* input, long size) {
+    printf("%s, settings \"%s\", %ld byte input written to %s\n", failure, s->name, size, FAILED_INPUT);
+    FILE* file = fopen(FAILED_INPUT, "wb");
+    if(file == NULL || fwrite(input, 1, size, file) != (size_t)size) perror(FAILED_INPUT);
+    if(file != NULL) fclose(file);
+}
+
+#ifdef LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if(size < 1 || size > MAX_INPUT) return 0;
+    const Settings* s = &settings[data[0] % N_SETTINGS];
+    applySettings(s);
+    const char* failure = checkInput(data + 1, size - 1);
+    if(failure != NULL) {
+        printf("%s, settings \"%s\"\n", failure, s->name);
+        abort();
+    }
+    return 0;
+}
+
+#else
+
+void usage(const char* program) {
+    printf("Usage: %s [-i iterations] [-s seed] [-f input]\n"
+           "  -f replays one input through the bounds checks under every setting,\n"
+           "  the same seed and iterations repeat a run\n", program);
+}
+
+// Runs the checks on the input in path under every setting.
+// Return "0" if they all hold or "-1" otherwise.
+int replay(const char* path) {
+    unsigned char input[MAX_INPUT];
+    FILE* file = fopen(path, "rb");
+    if(file == NULL) {
+        perror(path);
+        return -1;
+    }
+    long size = fread(input, 1, MAX_INPUT, file);
+    fclose(file);
+    int result = 0;
+    for(int i = 0; i < N_SETTINGS; i++) {
+        applySettings(&settings[i]);
+        const char* failure = checkInput(input, size);
+        if(failure != NULL) {
+            printf("%s, settings \"%s\"\n", failure, settings[i].name);
+            result = -1;
+        }
+    }
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = N_ITERATIONS;
+    unsigned int seed = 1;
+    const char* replayPath = NULL;
+
+    int option;
+    while((option = getopt(argc, argv, "i:s:f:h")) != -1) {
+        int valid = TRUE;
+        switch(option) {
+            case 'i': iterations = atol(optarg); valid = iterations > 0; break;
+            case 's': seed = strtoul(optarg, NULL, 10); break;
+            case 'f': replayPath = optarg; break;
+            default: valid = FALSE; break;
+        }
+        if(!valid) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(replayPath != NULL) return replay(replayPath) == 0 ? 0 : 1;
+
+    unsigned int firstSeed = seed;
+    unsigned char input[MAX_INPUT];
+    for(long i = 0; i < iterations; i++) {
+        const Settings* s = &settings[i % N_SETTINGS];
+        applySettings(s);
+        long size = generateInput(input, &seed);
+        const char* failure = checkInput(input, size);
+        if(failure == NULL && s->fcsMode == FCS_CRC32) failure = checkResync(input, &size, &seed);
+        if(failure != NULL) {
+            printf("Seed %u iteration %ld: ", firstSeed, i);
+            reportFailure(failure, s, input, size);
+            return 1;
+        }
+    }
+    printf("%ld inputs passed under %d settings\n", iterations, N_SETTINGS);
+    return 0;
+}
+
+#endif
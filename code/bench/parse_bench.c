@@ -0,0 +1,287 @@
+// Receive path microbenchmark.
+// Feeds byte streams built in memory through llreadOn (I-frames, on a receiver) and parseFrame (supervision
+// frames, on a transmitter) and prints the time each takes per byte of stream. Each parser sees clean frames,
+// frames whose payload is all FLAG and ESC so every byte is stuffed (I-frames only), garbage between the frames
+// and a copy cut short ahead of every frame.
+
+#include "link_layer.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STREAM_BYTES (4 * 1024 * 1024) // default size of each stream
+#define GARBAGE_BYTES 64 // most garbage between two frames
+#define N_REPEATS 5
+#define SEED 1
+
+#define FLAG_BYTE 0x7E
+#define ESC_BYTE 0x7D
+#define ADDRESS_BYTE 0x03 // address of the transmitter, left out of garbage so garbage never opens a frame
+
+extern FcsMode FCS_MODE;
+extern int FEC_STRENGTH;
+
+typedef enum
+{
+    CLEAN,
+    ESCAPED,
+    GARBAGE,
+    TRUNCATED,
+    N_KINDS
+} StreamKind;
+
+const char* kindNames[] = {"clean", "escaped", "garbage", "truncated"};
+
+// Bytes of a stream and the number of frames a parser must find in it.
+typedef struct
+{
+    unsigned char* data;
+    long size;
+    long capacity;
+    long frames;
+} Stream;
+
+long long nowNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Return "0" on success or "-1" on error.
+int streamAppend(Stream* stream, const unsigned char* bytes, long size) {
+    if(stream->size + size > stream->capacity) {
+        long capacity = stream->capacity > 0 ? stream->capacity : 4096;
+        while(capacity < stream->size + size) capacity *= 2;
+        unsigned char* data = realloc(stream->data, capacity);
+        if(data == NULL) {
+            printf("Failed to allocate stream\n");
+            return -1;
+        }
+        stream->data = data;
+        stream->capacity = capacity;
+    }
+    memcpy(stream->data + stream->size, bytes, size);
+    stream->size += size;
+    return 0;
+}
+
+// Appends a whole frame the way kind asks: alone, after garbage or after a copy of its first bytes. The copy
+// stops before the BCC1 of a supervision frame and before the last byte of an I-frame, so it never passes a check.
+// Return "0" on success or "-1" on error.
+int appendFrame(Stream* stream, StreamKind kind, const unsigned char* frame, int size, unsigned int* seed) {
+    if(kind == GARBAGE) {
+        unsigned char garbage[GARBAGE_BYTES];
+        int count = rand_r(seed) % (GARBAGE_BYTES + 1);
+        for(int i = 0; i < count; i++) {
+            // about one flag in four, so the parser keeps being pulled out of its hunt
+            if(rand_r(seed) % 4 == 0) {
+                garbage[i] = FLAG_BYTE;
+                continue;
+            }
+            do garbage[i] = rand_r(seed); while(garbage[i] == ADDRESS_BYTE);
+        }
+        if(streamAppend(stream, garbage, count) != 0) return -1;
+    }
+    if(kind == TRUNCATED && streamAppend(stream, frame, 1 + rand_r(seed) % (size - 2)) != 0) return -1;
+    if(streamAppend(stream, frame, size) != 0) return -1;
+    stream->frames++;
+    return 0;
+}
+
+// I-frames of payload bytes each, numbered in order, up to bytes of stream.
+// Return "0" on success or "-1" on error.
+int buildDataStream(Stream* stream, StreamKind kind, int payload, long bytes) {
+    LinkConnection* encoder = llconnectMemory(LlTx, NULL, 0, -1);
+    if(encoder == NULL) return -1;
+    unsigned int seed = SEED;
+    unsigned char data[MAX_PAYLOAD_SIZE];
+    EncodedFrame frame;
+    for(int ns = 0; stream->size < bytes; ns++) {
+        for(int i = 0; i < payload; i++) {
+            if(kind == ESCAPED) {
+                data[i] = i % 2 == 0 ? FLAG_BYTE : ESC_BYTE;
+            } else {
+                // anything but FLAG and ESC, the escaped stream covers those
+                do data[i] = rand_r(&seed); while(data[i] == FLAG_BYTE || data[i] == ESC_BYTE);
+            }
+        }
+        if(llencodeOn(encoder, data, payload, NULL, 0, &frame) != 0) {
+            llabandon(encoder);
+            return -1;
+        }
+        llnumberFrame(&frame, ns);
+        if(appendFrame(stream, kind, frame.data, frame.size, &seed) != 0) {
+            llabandon(encoder);
+            return -1;
+        }
+    }
+    llabandon(encoder);
+    return 0;
+}
+
+// Supervision frames taken from replies, one per frame from FLAG to FLAG, repeated up to bytes of stream.
+// Return "0" on success or "-1" on error.
+int buildReplyStream(Stream* stream, StreamKind kind, const Stream* replies, long bytes) {
+    unsigned int seed = SEED;
+    long offset = 0;
+    while(stream->size < bytes) {
+        long end = offset + 1;
+        while(end < replies->size && replies->data[end] != FLAG_BYTE) end++;
+        if(end >= replies->size) {
+            printf("Replies end in the middle of a frame\n");
+            return -1;
+        }
+        if(appendFrame(stream, kind, replies->data + offset, end + 1 - offset, &seed) != 0) return -1;
+        offset = end + 1 < replies->size ? end + 1 : 0;
+    }
+    return 0;
+}
+
+// Reads stream through llreadOn on a new receiver, writing its replies to output (-1 to discard them).
+// Return nanoseconds taken, or "-1" if not every frame in the stream came out.
+long long timeRead(const Stream* stream, int output) {
+    LinkConnection* conn = llconnectMemory(LlRx, stream->data, stream->size, output);
+    if(conn == NULL) return -1;
+    unsigned char packet[MAX_PAYLOAD_SIZE + MAX_FCS_SIZE];
+    long frames = 0;
+    int bytes;
+    long long start = nowNanos();
+    while((bytes = llreadOn(conn, packet)) > 0) frames++;
+    long long elapsed = nowNanos() - start;
+    llabandon(conn);
+    if(bytes < 0 || frames != stream->frames) {
+        printf("llread took %ld of %ld frames\n", frames, stream->frames);
+        return -1;
+    }
+    return elapsed;
+}
+
+// Reads stream through parseFrame on a new transmitter waiting for acknowledgements.
+// Return nanoseconds taken, or "-1" if not every frame in the stream came out.
+long long timeParse(const Stream* stream) {
+    LinkConnection* conn = llconnectMemory(LlTx, stream->data, stream->size, -1);
+    if(conn == NULL) return -1;
+    State state = START;
+    unsigned char received[7];
+    int index = 0;
+    long frames = 0;
+    long long start = nowNanos();
+    // parseFrame takes one byte per call
+    for(long i = 0; i < stream->size; i++) {
+        if(parseFrame(conn, WRITE, &state, received, &index)) {
+            frames++;
+            state = START;
+            index = 0;
+        }
+    }
+    long long elapsed = nowNanos() - start;
+    llabandon(conn);
+    if(frames != stream->frames) {
+        printf("parseFrame took %ld of %ld frames\n", frames, stream->frames);
+        return -1;
+    }
+    return elapsed;
+}
+
+void printRow(const char* parser, StreamKind kind, const Stream* stream, long long nanos) {
+    printf("%s,%s,%ld,%ld,%.3f,%.1f\n", parser, kindNames[kind], stream->size, stream->frames,
+           (double)nanos / stream->size, stream->size * 1e3 / nanos);
+    fflush(stdout);
+}
+
+// The replies the receiver writes for a clean stream, by reading it once into a temporary file.
+// Return "0" on success or "-1" on error.
+int captureReplies(int payload, long bytes, Stream* replies) {
+    Stream stream = {0};
+    FILE* file = tmpfile();
+    int result = -1;
+    if(file == NULL) {
+        perror("tmpfile");
+    } else if(buildDataStream(&stream, CLEAN, payload, bytes) == 0 && timeRead(&stream, fileno(file)) >= 0) {
+        long size = lseek(fileno(file), 0, SEEK_END);
+        unsigned char* data = malloc(size);
+        if(data != NULL && pread(fileno(file), data, size, 0) == size) {
+            replies->data = data;
+            replies->size = size;
+            replies->capacity = size;
+            result = 0;
+        } else {
+            free(data);
+            printf("Failed to read the replies back\n");
+        }
+    }
+    if(file != NULL) fclose(file);
+    free(stream.data);
+    return result;
+}
+
+void usage(const char* program) {
+    printf("Usage: %s [-p payload] [-n bytes] [-r repeats] [-f crc16|crc32] [-F fec]\n"
+           "  -n bytes of each stream, %d by default\n"
+           "  prints the best of the repeats as CSV, the I-frame times include writing each RR to /dev/null\n",
+           program, STREAM_BYTES);
+}
+
+int main(int argc, char *argv[]) {
+    int payload = MAX_PAYLOAD_SIZE;
+    long bytes = STREAM_BYTES;
+    int repeats = N_REPEATS;
+
+    int option;
+    while((option = getopt(argc, argv, "p:n:r:f:F:h")) != -1) {
+        int valid = TRUE;
+        switch(option) {
+            case 'p': payload = atoi(optarg); valid = payload >= 1 && payload <= MAX_PAYLOAD_SIZE; break;
+            case 'n': bytes = atol(optarg); valid = bytes > 0; break;
+            case 'r': repeats = atoi(optarg); valid = repeats > 0; break;
+            case 'f':
+                // BCC lets a truncated copy through now and then, which would spoil the frame counts
+                if(strcmp(optarg, "crc16") == 0) FCS_MODE = FCS_CRC16;
+                else if(strcmp(optarg, "crc32") == 0) FCS_MODE = FCS_CRC32;
+                else valid = FALSE;
+                break;
+            case 'F': FEC_STRENGTH = atoi(optarg); break;
+            default: valid = FALSE; break;
+        }
+        if(!valid) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(payload < 2) payload = 2; // room for a truncated copy of the frame
+
+    Stream replies = {0};
+    if(captureReplies(payload, bytes, &replies) != 0) return 1;
+
+    printf("parser,stream,bytes,frames,ns_per_byte,mb_per_s\n");
+    int nFailed = 0;
+    for(StreamKind kind = CLEAN; kind < N_KINDS; kind++) {
+        for(int reply = FALSE; reply <= TRUE; reply++) {
+            // supervision frames are never stuffed
+            if(reply && kind == ESCAPED) continue;
+            Stream stream = {0};
+            int built = reply ? buildReplyStream(&stream, kind, &replies, bytes) :
+                                buildDataStream(&stream, kind, payload, bytes);
+            long long best = -1;
+            for(int r = 0; built == 0 && r < repeats; r++) {
+                long long nanos = reply ? timeParse(&stream) : timeRead(&stream, -1);
+                if(nanos < 0) {
+                    best = -1;
+                    break;
+                }
+                if(best < 0 || nanos < best) best = nanos;
+            }
+            if(best > 0) {
+                printRow(reply ? "parseFrame" : "llread", kind, &stream, best);
+            } else {
+                nFailed++;
+            }
+            free(stream.data);
+        }
+    }
+    free(replies.data);
+    return nFailed > 0 ? 1 : 0;
+}
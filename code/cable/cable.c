@@ -5,12 +5,16 @@
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 
 #include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 // Baudrate settings are defined in <asm/termbits.h>, which is
@@ -21,14 +25,50 @@
 #define TRUE 1
 
 #define BUF_SIZE 2048
+#define DEFAULT_SEED 1
+#define LINE_QUEUE 65536 // bytes on their way in one direction, mostly propagating
+#define DEFAULT_BITS_PER_BYTE 10 // 8N1: start, 8 data and stop bit
 
 typedef enum
 {
     CableModeOn,
     CableModeOff,
     CableModeNoise,
+    CableModeErrors,
 } CableMode;
 
+// One direction of the cable: its error model, applied in CableModeErrors, and its timing, applied in every mode.
+// Bit errors follow a Gilbert-Elliott chain: each bit the line may move between a good and a bad state, and
+// flips with the bit error rate of the state it is in. With burst off the line stays in the good state, which
+// makes it a plain random bit error rate.
+typedef struct
+{
+    const char *name;
+    double ber;          // bit error rate in the good state
+    int burst;           // TRUE to use the bad state
+    double goodToBad;    // chance per bit of moving to the bad state
+    double badToGood;    // chance per bit of moving back, 1 / mean burst length in bits
+    double berBad;       // bit error rate in the bad state
+    double dropRate;     // chance per byte of losing it
+    double insertRate;   // chance per byte of a random byte showing up ahead of it
+    uint64_t random;     // generator state, seeded so a run can be repeated
+    int bad;
+    unsigned long bytes;
+    unsigned long bitErrors;
+    unsigned long drops;
+    unsigned long inserts;
+
+    // Each byte takes bitsPerByte / baud seconds on the line, after the ones ahead of it, and comes out delay ms later.
+    int baud;            // 0 for no pacing
+    int bitsPerByte;     // start, data, parity and stop bits
+    double delay;        // ms, one-way propagation delay
+    unsigned char *queue; // bytes read and not yet delivered, ring of LINE_QUEUE
+    long long *due;      // us, when each one comes out
+    int head;
+    int count;
+    double lineFreeAt;   // us, when the last byte queued is clocked out
+} Channel;
+
 // Returns: serial port file descriptor (fd).
 int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
 {
@@ -62,8 +102,351 @@ void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
     buf[errorIndex] ^= 0xFF;
 }
 
+// splitmix64: small, fast and the same sequence for the same seed everywhere.
+uint64_t nextRandom(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Returns: a number in [0, 1).
+double nextUniform(uint64_t *state)
+{
+    return (nextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Restarts the generators of both directions from seed, each direction on its own sequence.
+void seedChannels(Channel *tx2rx, Channel *rx2tx, unsigned long seed)
+{
+    tx2rx->random = (uint64_t)seed * 2;
+    rx2tx->random = (uint64_t)seed * 2 + 1;
+    tx2rx->bad = FALSE;
+    rx2tx->bad = FALSE;
+}
+
+// Byte as it comes out of the line, with each bit passed through the Gilbert-Elliott chain.
+unsigned char corruptByte(Channel *channel, unsigned char byte)
+{
+    if (channel->ber == 0 && !channel->burst)
+        return byte;
+
+    for (int bit = 0; bit < 8; bit++)
+    {
+        if (channel->burst)
+        {
+            if (nextUniform(&channel->random) < (channel->bad ? channel->badToGood : channel->goodToBad))
+                channel->bad = !channel->bad;
+        }
+        double ber = channel->bad ? channel->berBad : channel->ber;
+        if (ber > 0 && nextUniform(&channel->random) < ber)
+        {
+            byte ^= 1 << bit;
+            channel->bitErrors++;
+        }
+    }
+    return byte;
+}
+
+// Passes size bytes of in through the error model of channel into out, which needs room for 2 * size bytes.
+// Returns: number of bytes written to out.
+int applyChannel(Channel *channel, const unsigned char *in, int size, unsigned char *out)
+{
+    int written = 0;
+    for (int i = 0; i < size; i++)
+    {
+        if (channel->insertRate > 0 && nextUniform(&channel->random) < channel->insertRate)
+        {
+            out[written++] = nextRandom(&channel->random) & 0xFF;
+            channel->inserts++;
+        }
+        if (channel->dropRate > 0 && nextUniform(&channel->random) < channel->dropRate)
+        {
+            channel->drops++;
+            continue;
+        }
+        out[written++] = corruptByte(channel, in[i]);
+    }
+    return written;
+}
+
+long long nowMicros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Returns: 0 on success, -1 on error.
+int lineInit(Channel *channel)
+{
+    channel->queue = malloc(LINE_QUEUE);
+    channel->due = malloc(LINE_QUEUE * sizeof(long long));
+    return channel->queue != NULL && channel->due != NULL ? 0 : -1;
+}
+
+void lineFree(Channel *channel)
+{
+    free(channel->queue);
+    free(channel->due);
+}
+
+// Returns: milliseconds until the next byte of channel is due, -1 if there is none.
+int lineWait(const Channel *channel, long long now)
+{
+    if (channel->count == 0)
+        return -1;
+    long long wait = channel->due[channel->head] - now;
+    return wait > 0 ? (wait + 999) / 1000 : 0;
+}
+
+// Puts size bytes read at now on the line, each one due once it is clocked out and has propagated.
+// The caller makes sure there is room.
+void lineSend(Channel *channel, const unsigned char *buf, int size, long long now)
+{
+    double byteTime = channel->baud > 0 ? channel->bitsPerByte * 1e6 / channel->baud : 0;
+    if (channel->lineFreeAt < now)
+        channel->lineFreeAt = now;
+    for (int i = 0; i < size; i++)
+    {
+        int slot = (channel->head + channel->count) % LINE_QUEUE;
+        channel->lineFreeAt += byteTime;
+        channel->queue[slot] = buf[i];
+        channel->due[slot] = (long long)(channel->lineFreeAt + channel->delay * 1000);
+        channel->count++;
+    }
+    channel->bytes += size;
+}
+
+// Returns: milliseconds until the line has clocked out what it was given and takes more, 0 if it does now.
+// Until then the port is left unread, so the writer is held back by its own buffer as with a real UART.
+int lineBusy(const Channel *channel, long long now)
+{
+    if (LINE_QUEUE - channel->count < 2 * BUF_SIZE)
+        return lineWait(channel, now) > 0 ? lineWait(channel, now) : 1;
+    double busy = channel->lineFreeAt - now;
+    return busy > 0 ? (int)((busy + 999) / 1000) : 0;
+}
+
+// Writes the bytes due by now to fd.
+// Returns: number of bytes written, -1 on error.
+int lineDeliver(Channel *channel, int fd, long long now)
+{
+    int total = 0;
+    while (channel->count > 0 && channel->due[channel->head] <= now)
+    {
+        // the due bytes up to the end of the ring
+        int size = 0;
+        while (size < channel->count && channel->head + size < LINE_QUEUE &&
+               channel->due[channel->head + size] <= now)
+            size++;
+        int written = write(fd, channel->queue + channel->head, size);
+        if (written < 0)
+            return -1;
+        channel->head = (channel->head + written) % LINE_QUEUE;
+        channel->count -= written;
+        total += written;
+        if (written < size)
+            break;
+    }
+    return total;
+}
+
+void printChannel(const Channel *channel)
+{
+    printf("%s: ", channel->name);
+    if (channel->baud > 0)
+        printf("baud=%d bits=%d ", channel->baud, channel->bitsPerByte);
+    printf("delay=%gms ber=%g", channel->delay, channel->ber);
+    if (channel->burst)
+        printf(" burst=%g:%g:%g", channel->goodToBad, channel->badToGood, channel->berBad);
+    printf(" drop=%g insert=%g | bytes=%lu bitErrors=%lu drops=%lu inserts=%lu\n", channel->dropRate,
+           channel->insertRate, channel->bytes, channel->bitErrors, channel->drops, channel->inserts);
+}
+
+// Returns: TRUE if text is a probability, stored in value.
+int parseRate(const char *text, double *value)
+{
+    char *end;
+    double rate = strtod(text, &end);
+    if (end == text || *end != '\0' || rate < 0 || rate > 1)
+        return FALSE;
+    *value = rate;
+    return TRUE;
+}
+
+// Returns: TRUE if text is "goodToBad:badToGood:berBad" or "off", stored in channel.
+int parseBurst(const char *text, Channel *channel)
+{
+    if (strcmp(text, "off") == 0)
+    {
+        channel->burst = FALSE;
+        channel->bad = FALSE;
+        return TRUE;
+    }
+    char copy[64];
+    snprintf(copy, sizeof(copy), "%s", text);
+    char *fields[3];
+    int count = 0;
+    for (char *field = strtok(copy, ":"); field != NULL && count < 3; field = strtok(NULL, ":"))
+        fields[count++] = field;
+    Channel parsed = *channel;
+    if (count != 3 || !parseRate(fields[0], &parsed.goodToBad) || !parseRate(fields[1], &parsed.badToGood) ||
+        !parseRate(fields[2], &parsed.berBad))
+        return FALSE;
+    parsed.burst = TRUE;
+    *channel = parsed;
+    return TRUE;
+}
+
+// Returns: TRUE if text is a data bits, parity and stop bits framing such as "8N1", stored in channel.
+int parseFraming(const char *text, Channel *channel)
+{
+    if (strlen(text) != 3 || text[0] < '5' || text[0] > '8' || strchr("NEO", text[1]) == NULL ||
+        (text[2] != '1' && text[2] != '2'))
+        return FALSE;
+    channel->bitsPerByte = 1 + (text[0] - '0') + (text[1] != 'N') + (text[2] - '0');
+    return TRUE;
+}
+
+// Returns: TRUE if text is a number from 0 up, stored in value.
+int parseAmount(const char *text, double *value)
+{
+    char *end;
+    double amount = strtod(text, &end);
+    if (end == text || *end != '\0' || amount < 0)
+        return FALSE;
+    *value = amount;
+    return TRUE;
+}
+
+// Sets one setting of channel from text.
+// Returns: TRUE if text is valid for the setting.
+int setChannel(Channel *channel, char setting, const char *text)
+{
+    switch (setting)
+    {
+    case 'b':
+        return parseRate(text, &channel->ber);
+    case 'g':
+        return parseBurst(text, channel);
+    case 'd':
+        return parseRate(text, &channel->dropRate);
+    case 'i':
+        return parseRate(text, &channel->insertRate);
+    case 'B':
+    {
+        double baud;
+        if (!parseAmount(text, &baud))
+            return FALSE;
+        channel->baud = baud;
+        return TRUE;
+    }
+    case 'p':
+        return parseAmount(text, &channel->delay);
+    case 'f':
+        return parseFraming(text, channel);
+    default:
+        return FALSE;
+    }
+}
+
+// Command line form of a setting: "value" for both directions or "tx2rx,rx2tx" for each.
+// Returns: TRUE if text is valid.
+int setChannels(Channel *tx2rx, Channel *rx2tx, char setting, const char *text)
+{
+    char copy[128];
+    snprintf(copy, sizeof(copy), "%s", text);
+    char *comma = strchr(copy, ',');
+    if (comma == NULL)
+        return setChannel(tx2rx, setting, copy) && setChannel(rx2tx, setting, copy);
+    *comma = '\0';
+    return setChannel(tx2rx, setting, copy) && setChannel(rx2tx, setting, comma + 1);
+}
+
+// Interactive form of a setting: "<command> <value> [tx|rx]", tx being the direction from the transmitter.
+// Returns: TRUE if command is a valid setting, applied to channels, "isError" telling an error model setting.
+int commandChannels(Channel *tx2rx, Channel *rx2tx, const char *command, int *isError)
+{
+    const char *names[] = {"ber", "burst", "drop", "insert", "baud", "delay", "framing"};
+    const char settings[] = {'b', 'g', 'd', 'i', 'B', 'p', 'f'};
+    char name[16], value[64], direction[8];
+    int fields = sscanf(command, "%15s %63s %7s", name, value, direction);
+    if (fields < 2)
+        return FALSE;
+    for (int i = 0; i < (int)sizeof(settings); i++)
+    {
+        if (strcmp(name, names[i]) != 0)
+            continue;
+        *isError = strchr("bgdi", settings[i]) != NULL;
+        if (fields == 2)
+            return setChannels(tx2rx, rx2tx, settings[i], value);
+        if (strcmp(direction, "tx") == 0)
+            return setChannel(tx2rx, settings[i], value);
+        if (strcmp(direction, "rx") == 0)
+            return setChannel(rx2tx, settings[i], value);
+        return FALSE;
+    }
+    return FALSE;
+}
+
+void usage(const char *program)
+{
+    printf("Usage: %s [-b ber] [-g goodToBad:badToGood:berBad] [-d drop] [-i insert] [-s seed]\n"
+           "       [-B baud] [-f framing] [-p delay]\n"
+           "  each setting takes one value for both directions, or \"tx2rx,rx2tx\"\n"
+           "  -b, -g, -d and -i start the cable in errors mode\n"
+           "  -B paces the bytes at the baud rate (0 for no pacing), with the start, parity and stop bits of\n"
+           "  the framing (8N1 by default), -p delays them by a propagation delay in ms\n",
+           program);
+}
+
 int main(int argc, char *argv[])
 {
+    Channel tx2rxChannel = {.name = "tx2rx", .bitsPerByte = DEFAULT_BITS_PER_BYTE};
+    Channel rx2txChannel = {.name = "rx2tx", .bitsPerByte = DEFAULT_BITS_PER_BYTE};
+    unsigned long seed = DEFAULT_SEED;
+    CableMode cableMode = CableModeOn;
+
+    int option;
+    while ((option = getopt(argc, argv, "b:g:d:i:s:B:f:p:h")) != -1)
+    {
+        int valid = TRUE;
+        switch (option)
+        {
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+        case 'g':
+        case 'd':
+        case 'i':
+            valid = setChannels(&tx2rxChannel, &rx2txChannel, option, optarg);
+            cableMode = CableModeErrors;
+            break;
+        case 'B':
+        case 'f':
+        case 'p':
+            valid = setChannels(&tx2rxChannel, &rx2txChannel, option, optarg);
+            break;
+        default:
+            valid = FALSE;
+            break;
+        }
+        if (!valid)
+        {
+            usage(argv[0]);
+            exit(-1);
+        }
+    }
+    seedChannels(&tx2rxChannel, &rx2txChannel, seed);
+    if (lineInit(&tx2rxChannel) != 0 || lineInit(&rx2txChannel) != 0)
+    {
+        printf("Failed to allocate the line queues\n");
+        exit(-1);
+    }
+
     printf("\n");
 
     system("socat -dd PTY,link=/dev/ttyS10,mode=777 PTY,link=/dev/emulatorTx,mode=777 &");
@@ -81,7 +464,19 @@ int main(int argc, char *argv[])
            "--- on           : connect the cable and data is exchanged (default state)\n"
            "--- off          : disconnect the cable disabling data to be exchanged\n"
            "--- noise        : add fixed noise to the cable\n"
+           "--- errors       : pass data through the error models below\n"
+           "--- ber R [tx|rx]             : random bit error rate R\n"
+           "--- burst G:B:R [tx|rx]       : Gilbert-Elliott bursts, G/B chance per bit to go bad/good, R ber when bad\n"
+           "--- burst off [tx|rx]         : no bursts\n"
+           "--- drop R [tx|rx]            : drop each byte with chance R\n"
+           "--- insert R [tx|rx]          : insert a random byte ahead of each byte with chance R\n"
+           "--- baud N [tx|rx]            : pace the bytes at N baud, 0 for no pacing\n"
+           "--- framing 8N1 [tx|rx]       : data bits, parity and stop bits each byte takes at that baud rate\n"
+           "--- delay MS [tx|rx]          : one-way propagation delay in ms\n"
+           "--- seed N       : restart the error models from seed N\n"
+           "--- stats        : show the line settings and the errors they caused\n"
            "--- end          : terminate the program\n"
+           "(tx is the direction from the transmitter, rx the one back, both when left out)\n"
            "\n");
 
     // Configure serial ports
@@ -113,17 +508,45 @@ int main(int argc, char *argv[])
 
     unsigned char tx2rx[BUF_SIZE] = {0};
     unsigned char rx2tx[BUF_SIZE] = {0};
-    char rxStdin[BUF_SIZE] = {0};
+    unsigned char channelOut[2 * BUF_SIZE] = {0};
+    char rxStdin[BUF_SIZE + 1] = {0};
 
-    CableMode cableMode = CableModeOn;
     volatile int STOP = FALSE;
+    int stdinFd = STDIN_FILENO; // -1 once stdin is closed
+    int isError = FALSE;
 
+    if (cableMode == CableModeErrors)
+        printf("CONNECTION ERRORS, seed %lu\n", seed);
+    printChannel(&tx2rxChannel);
+    printChannel(&rx2txChannel);
     printf("Cable ready\n");
 
     while (STOP == FALSE)
     {
+        // Wait for a port whose line is free, a command, the next byte due or a line getting free. A read on an
+        // idle port would hold the other direction for VTIME.
+        long long now = nowMicros();
+        int waits[] = {lineWait(&tx2rxChannel, now), lineWait(&rx2txChannel, now), lineBusy(&tx2rxChannel, now),
+                       lineBusy(&rx2txChannel, now)};
+        int timeout = -1;
+        for (int i = 0; i < 4; i++)
+        {
+            if (waits[i] > 0 && (timeout < 0 || waits[i] < timeout))
+                timeout = waits[i];
+            if (waits[i] == 0 && i < 2)
+                timeout = 0;
+        }
+        struct pollfd fds[] = {{waits[2] == 0 ? fdTx : -1, POLLIN, 0}, {waits[3] == 0 ? fdRx : -1, POLLIN, 0},
+                               {stdinFd, POLLIN, 0}};
+        if (poll(fds, 3, timeout) == -1)
+        {
+            perror("poll");
+            break;
+        }
+        now = nowMicros();
+
         // Read from Tx
-        int bytesFromTx = read(fdTx, tx2rx, BUF_SIZE);
+        int bytesFromTx = fds[0].revents ? read(fdTx, tx2rx, BUF_SIZE) : 0;
 
         if (bytesFromTx > 0)
         {
@@ -133,18 +556,25 @@ int main(int argc, char *argv[])
             }
             else
             {
+                unsigned char *out = tx2rx;
+                int size = bytesFromTx;
                 if (cableMode == CableModeNoise)
                 {
                     addNoiseToBuffer(tx2rx, 0);
                 }
+                else if (cableMode == CableModeErrors)
+                {
+                    out = channelOut;
+                    size = applyChannel(&tx2rxChannel, tx2rx, bytesFromTx, channelOut);
+                }
 
-                int bytesToRx = write(fdRx, tx2rx, bytesFromTx);
-                printf("bytesFromTx=%d > bytesToRx=%d\n", bytesFromTx, bytesToRx);
+                lineSend(&tx2rxChannel, out, size, now);
+                printf("bytesFromTx=%d > bytesToRx=%d\n", bytesFromTx, size);
             }
         }
 
         // Read from Rx
-        int bytesFromRx = read(fdRx, rx2tx, BUF_SIZE);
+        int bytesFromRx = fds[1].revents ? read(fdRx, rx2tx, BUF_SIZE) : 0;
 
         if (bytesFromRx > 0)
         {
@@ -154,41 +584,95 @@ int main(int argc, char *argv[])
             }
             else
             {
+                unsigned char *out = rx2tx;
+                int size = bytesFromRx;
                 if (cableMode == CableModeNoise)
                 {
                     addNoiseToBuffer(rx2tx, 0);
                 }
+                else if (cableMode == CableModeErrors)
+                {
+                    out = channelOut;
+                    size = applyChannel(&rx2txChannel, rx2tx, bytesFromRx, channelOut);
+                }
 
-                int bytesToTx = write(fdTx, rx2tx, bytesFromRx);
-                printf("bytesToTx=%d < bytesFromRx=%d\n", bytesToTx, bytesFromRx);
+                lineSend(&rx2txChannel, out, size, now);
+                printf("bytesToTx=%d < bytesFromRx=%d\n", size, bytesFromRx);
             }
         }
 
+        if (lineDeliver(&tx2rxChannel, fdRx, now) == -1 || lineDeliver(&rx2txChannel, fdTx, now) == -1)
+        {
+            perror("write");
+            break;
+        }
+
         // Read commands from STDIN to control the cable mode
-        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
+        int fromStdin = fds[2].revents ? read(STDIN_FILENO, rxStdin, BUF_SIZE) : -1;
+        if (fromStdin == 0)
+            stdinFd = -1;
         if (fromStdin > 0)
         {
-            rxStdin[fromStdin - 1] = '\0';
-
-            if (strcmp(rxStdin, "off") == 0 || strcmp(rxStdin, "0") == 0)
-            {
-                printf("CONNECTION OFF\n");
-                cableMode = CableModeOff;
-            }
-            else if (strcmp(rxStdin, "on") == 0 || strcmp(rxStdin, "1") == 0)
-            {
-                printf("CONNECTION ON\n");
-                cableMode = CableModeOn;
-            }
-            else if (strcmp(rxStdin, "noise") == 0 || strcmp(rxStdin, "2") == 0)
+            // one command per line, several may come in one read
+            rxStdin[fromStdin] = '\0';
+            char *next = rxStdin;
+            while (*next != '\0')
             {
-                printf("CONNECTION NOISE\n");
-                cableMode = CableModeNoise;
-            }
-            else if (strcmp(rxStdin, "end") == 0)
-            {
-                printf("END OF THE PROGRAM\n");
-                STOP = TRUE;
+                char *command = next;
+                next += strcspn(next, "\n");
+                if (*next == '\n')
+                    *next++ = '\0';
+
+                if (strcmp(command, "off") == 0 || strcmp(command, "0") == 0)
+                {
+                    printf("CONNECTION OFF\n");
+                    cableMode = CableModeOff;
+                }
+                else if (strcmp(command, "on") == 0 || strcmp(command, "1") == 0)
+                {
+                    printf("CONNECTION ON\n");
+                    cableMode = CableModeOn;
+                }
+                else if (strcmp(command, "noise") == 0 || strcmp(command, "2") == 0)
+                {
+                    printf("CONNECTION NOISE\n");
+                    cableMode = CableModeNoise;
+                }
+                else if (strcmp(command, "errors") == 0 || strcmp(command, "3") == 0)
+                {
+                    printf("CONNECTION ERRORS\n");
+                    cableMode = CableModeErrors;
+                }
+                else if (strncmp(command, "seed ", 5) == 0)
+                {
+                    seed = strtoul(command + 5, NULL, 10);
+                    seedChannels(&tx2rxChannel, &rx2txChannel, seed);
+                    printf("SEED %lu\n", seed);
+                }
+                else if (strcmp(command, "stats") == 0)
+                {
+                    printChannel(&tx2rxChannel);
+                    printChannel(&rx2txChannel);
+                }
+                else if (commandChannels(&tx2rxChannel, &rx2txChannel, command, &isError))
+                {
+                    if (isError)
+                    {
+                        printf("CONNECTION ERRORS\n");
+                        cableMode = CableModeErrors;
+                    }
+                    printChannel(&tx2rxChannel);
+                    printChannel(&rx2txChannel);
+                }
+                else if (strcmp(command, "end") == 0)
+                {
+                    printf("END OF THE PROGRAM\n");
+                    STOP = TRUE;
+                }
+                else if (command[0] != '\0')
+                {
+                    printf("Unknown command \"%s\"\n", command);
+                }
             }
         }
     }
@@ -208,6 +692,8 @@ int main(int argc, char *argv[])
 
     close(fdTx);
     close(fdRx);
+    lineFree(&tx2rxChannel);
+    lineFree(&rx2txChannel);
 
     system("killall socat");
 
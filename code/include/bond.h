@@ -0,0 +1,53 @@
+// Link bonding header.
+
+#ifndef _BOND_H_
+#define _BOND_H_
+
+#include "link_layer.h"
+
+#define MAX_BOND_LINKS 8
+#define BOND_HEADER 5 // kind and sequence number ahead of every packet of a bond
+
+// Several serial links between the same two hosts used as one: packets are numbered, spread over the links
+// and put back in order on the other end.
+typedef struct Bond Bond;
+
+// Opens a link on each port of the comma separated list in connectionParameters.serialPort, one after the other,
+// in the same order on both ends.
+// Return the bond, or NULL on error.
+Bond* bondOpen(LinkLayer connectionParameters);
+
+// Stuffs header and data behind the next sequence number into frame, ready for bondWriteEncoded.
+// May run on another thread than the one writing.
+// Return "0" on success or "-1" on error.
+int bondEncode(Bond* bond, const unsigned char *header, int headerSize, const unsigned char *data, int dataSize,
+               EncodedFrame *frame);
+
+// Queues a frame prepared by bondEncode for the first link that has room in its window, so each link carries
+// packets in proportion to the throughput it manages. Frames of a link that fails go out on the others.
+// The receiving end only writes replies, in turns, on the first link still up.
+// Return number of payload chars written, or "-1" once every link failed.
+int bondWriteEncoded(Bond* bond, const EncodedFrame *frame);
+
+// Send a packet made of header followed by data, as bondEncode and bondWriteEncoded.
+// Return number of chars written, or "-1" on error.
+int bondWritePacket(Bond* bond, const unsigned char *header, int headerSize, const unsigned char *data, int dataSize);
+
+// Wait until every packet queued so far is acknowledged.
+// Return "0" on success or "-1" on error.
+int bondFlush(Bond* bond);
+
+// Receive the next packet in sequence, whichever link it came on. Packet must be allocated with
+// MAX_PAYLOAD_SIZE + MAX_FCS_SIZE bytes. Gives up like llread when no link has brought anything for a while.
+// Return number of chars read, or "-1" on error.
+int bondRead(Bond* bond, unsigned char *packet);
+
+// Mean frame error rate of the links still up.
+double bondFrameErrorRate(Bond* bond);
+
+// Close every link, bond is freed even on error.
+// if showStatistics == TRUE, the share and throughput of each link are printed with its link layer statistics.
+// Return "0" on success or "-1" on error.
+int bondClose(Bond* bond, int showStatistics);
+
+#endif // _BOND_H_
@@ -45,53 +45,162 @@ typedef enum
     CLOSERX
 } Action;
 
+typedef enum
+{
+    ARQ_STOP_AND_WAIT,
+    ARQ_GO_BACK_N,
+    ARQ_SELECTIVE_REPEAT
+} ArqMode;
+
+typedef enum
+{
+    FCS_BCC,
+    FCS_CRC16,
+    FCS_CRC32
+} FcsMode;
+
 typedef struct
 {
-    char serialPort[50];
+    char serialPort[256]; // a comma separated list of ports opens them all as one bonded link
     LinkLayerRole role;
     int baudRate;
     int nRetransmissions;
     int timeout;
 } LinkLayer;
 
+// One open serial link. Any number may be open at once, each used by one thread at a time.
+typedef struct LinkConnection LinkConnection;
+
 // SIZE of maximum acceptable payload.
 // Maximum number of bytes that application layer should send to link layer
 #define MAX_PAYLOAD_SIZE 1000
 
+// Largest frame check sequence, llread needs this much room after the payload.
+#define MAX_FCS_SIZE 4
+
+// Most Reed-Solomon check bytes on one I-frame, for MAX_PAYLOAD_SIZE + MAX_FCS_SIZE bytes at the strongest code.
+#define MAX_FEC_SIZE 150
+
+// Largest I-frame on the line, with every payload, FCS and check byte stuffed.
+#define MAX_FRAME_SIZE (2 * (MAX_PAYLOAD_SIZE + MAX_FCS_SIZE + MAX_FEC_SIZE) + 5)
+
 // MISC
 #define FALSE 0
 #define TRUE 1
 
+// I-frame stuffed ahead of time by llencode, everything but the frame header.
+typedef struct
+{
+    int size;        // frame bytes in data, the first 4 are filled in on sending
+    int payloadSize; // unstuffed bytes
+    unsigned int bondSeq; // sequence number in a bond, set by bondEncode
+    unsigned char data[MAX_FRAME_SIZE];
+} EncodedFrame;
+
 // Handles the control field (buf) of a packet, depending on the act.
 // Return "1" on good field, "0" otherwise.
 int cHandler(Action act, unsigned char buf);
 
-// Parses a frame (control and supervision), writing it to received and updating index and state, depending on the act.
+// Parses a frame (control and supervision) from conn, writing it to received and updating index and state, depending on the act.
+// SET and UA may carry a one byte parameter, received must then hold 7 bytes.
+// An I-frame from the peer while writing or waiting for DISC is read up to its closing flag, only its header is kept.
 // Return "1" on a complete packet, "0" otherwise
-int parseFrame(Action act, State* state, unsigned char* received, int* index);
+int parseFrame(LinkConnection* conn, Action act, State* state, unsigned char* received, int* index);
+
+// Microseconds on CLOCK_MONOTONIC, the clock of the link layer timers and statistics.
+long long nowMicros();
 
 // Open a connection using the "port" parameters defined in struct linkLayer.
-// Return "1" on success or "-1" on error.
+// Return the connection, or NULL on error.
+LinkConnection* llconnect(LinkLayer connectionParameters);
+
+// Connection that reads the size bytes at input instead of a serial port and writes to the file descriptor output
+// (-1 to discard), with the FCS and FEC the settings ask for and no SET/UA exchange. For benchmarks and fuzzing of
+// the receive path: llreadOn returns "0" once input is used up. Free it with llabandon.
+// Return the connection, or NULL on error.
+LinkConnection* llconnectMemory(LinkLayerRole role, const unsigned char *input, long size, int output);
+
+// Open the connection used by llwrite, llread and the others without a LinkConnection, only one at a time.
+// Several ports in connectionParameters.serialPort are opened as a bond.
+// Return "0" on success or "-1" on error.
 int llopen(LinkLayer connectionParameters);
 
+// Largest packet llwrite takes on the connection from llopen, a bond numbers each packet in its first bytes.
+int llpayloadLimit();
+
 // Writes byte to buffer, escaping FLAG and ESC. Updates index to last open slot.
 void writeByte(const unsigned char* byte, unsigned char* buffer, int* idx);
 
-// Send data in buf with size bufSize.
+// Stuffs size bytes of src into dst (room for 2 * size bytes), XORing them into bcc2.
+// Return number of bytes written to dst.
+int stuffBytes(const unsigned char* src, int size, unsigned char* dst, unsigned char* bcc2);
+
+// Send a packet made of header followed by data as one I-frame, stuffing both straight from where they are.
+// Return number of chars written, or "-1" on error.
+int llwritePacketOn(LinkConnection* conn, const unsigned char *header, int headerSize, const unsigned char *data, int dataSize);
+int llwritePacket(const unsigned char *header, int headerSize, const unsigned char *data, int dataSize);
+
+// Stuffs header and data with their FCS into frame, ready for llwriteEncoded. Needs no link state besides the
+// negotiated FCS, so it may run on another thread once llopen has returned.
+// Return "0" on success or "-1" on error.
+int llencodeOn(LinkConnection* conn, const unsigned char *header, int headerSize, const unsigned char *data, int dataSize, EncodedFrame *frame);
+int llencode(const unsigned char *header, int headerSize, const unsigned char *data, int dataSize, EncodedFrame *frame);
+
+// Fills in the header llwriteEncodedOn would give frame as I-frame number ns, for replaying encoded frames
+// from memory.
+void llnumberFrame(EncodedFrame *frame, int ns);
+
+// Send a frame prepared by llencode, which may be reused as soon as this returns.
+// Return number of payload chars written, or "-1" on error.
+int llwriteEncodedOn(LinkConnection* conn, const EncodedFrame *frame);
+int llwriteEncoded(const EncodedFrame *frame);
+
+// Send data in buf with size bufSize. Returns as soon as the frame is sent if the window has room,
+// acknowledgements are collected while it is full and in llclose.
 // Return number of chars written, or "-1" on error.
+int llwriteOn(LinkConnection* conn, const unsigned char *buf, int bufSize);
 int llwrite(const unsigned char *buf, int bufSize);
 
-// Send data response depending on valid packet and control field.
+// Wait until every frame sent so far is acknowledged. Either side may write, but only in turns: a side that
+// waits for a reply with llread flushes first, the receiver flushes its replies before reading on.
+// Return "0" on success or "-1" on error.
+int llflushOn(LinkConnection* conn);
+int llflush();
+
+// Smoothed fraction of recent I-frames that were rejected or timed out and had to be sent again.
+double llframeErrorRateOn(LinkConnection* conn);
+double llframeErrorRate();
+
+// Send data response on conn depending on valid packet and its sequence number ns, buffering out of order packets on selective repeat.
 // Return "1" to save packet, "0" to discard it and "-1" on write fail. 
-int sendDataResponse(int valid, unsigned char control);
+int sendDataResponse(LinkConnection* conn, int valid, int ns, const unsigned char* packet, int size);
 
-// Receive data in packet. Packet must be allocated with 1 extra byte for bcc reading.
-// Return number of chars read, or "-1" on error.
+// Receive data in packet. Packet must be allocated with MAX_PAYLOAD_SIZE + MAX_FCS_SIZE bytes.
+// Return number of chars read, "0" if llinterrupt was called, or "-1" on error.
+// llread also gives up with "-1" once nothing has come for (nRetransmissions + 1) timeouts, longer than the other
+// end keeps sending a frame again.
+int llreadOn(LinkConnection* conn, unsigned char *packet);
 int llread(unsigned char *packet);
 
-// Close previously opened connection.
+// Make the llreadOn under way on conn, or the next one, return "0". May be called from any thread.
+void llinterrupt(LinkConnection* conn);
+
+// Number of frames sent on conn and not yet acknowledged.
+int lloutstandingOn(LinkConnection* conn);
+
+// When the bytes written on conn so far will have left the line (us, CLOCK_MONOTONIC) and the time one more byte
+// takes, as the retransmission timer models them, "0" when the baud rate is unknown. Only the thread writing on conn
+// may call them.
+long long lllineFreeAtOn(LinkConnection* conn);
+double llbyteTimeOn(LinkConnection* conn);
+
+// Free conn without DISC, for a link that is known to be down.
+void llabandon(LinkConnection* conn);
+
+// Close previously opened connection, conn is freed even on error.
 // if showStatistics == TRUE, link layer should print statistics in the console on close.
-// Return "1" on success or "-1" on error.
+// Return "0" on success or "-1" on error.
+int lldisconnect(LinkConnection* conn, int showStatistics);
 int llclose(int showStatistics);
 
 #endif // _LINK_LAYER_H_
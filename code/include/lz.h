@@ -0,0 +1,18 @@
+// LZ77 block codec header.
+
+#ifndef _LZ_H_
+#define _LZ_H_
+
+#define LZ_MAX_INPUT 65535 // offsets and positions are 16 bit
+
+// Compresses size bytes of src (at most LZ_MAX_INPUT) into dst.
+// Sequences are a token (literal count << 4 | match length - 4), extra count bytes when a nibble is 15,
+// the literals, then a little-endian 16 bit match offset and extra length bytes. The last sequence has no match.
+// Return the compressed size, or "-1" if it does not fit in capacity bytes.
+int lzCompress(const unsigned char *src, int size, unsigned char *dst, int capacity);
+
+// Expands size bytes of src from lzCompress into dst.
+// Return the expanded size, or "-1" if the input is malformed or does not fit in capacity bytes.
+int lzDecompress(const unsigned char *src, int size, unsigned char *dst, int capacity);
+
+#endif // _LZ_H_
@@ -0,0 +1,45 @@
+// Reed-Solomon block code header.
+
+#ifndef _REED_SOLOMON_H_
+#define _REED_SOLOMON_H_
+
+#define RS_CODEWORD 255      // symbols (bytes) per full codeword over GF(256)
+#define RS_MAX_STRENGTH 15   // correctable byte errors per codeword
+
+typedef struct
+{
+    int parity;                                    // 2 * strength check bytes per codeword
+    unsigned char generator[2 * RS_MAX_STRENGTH + 1]; // highest degree first, monic
+} RsCode;
+
+// Builds the code that corrects strength byte errors per codeword (1 to RS_MAX_STRENGTH).
+void rsBuildCode(RsCode *code, int strength);
+
+// Number of check bytes added to a block of size bytes.
+int rsParitySize(const RsCode *code, int size);
+
+// Splits size bytes of data into as few shortened codewords as fit, interleaved byte by byte so a burst is
+// spread over all of them, and writes their check bytes, codeword after codeword, to parity.
+void rsEncode(const RsCode *code, const unsigned char *data, int size, unsigned char *parity);
+
+// Corrects in place a block of size bytes, data followed by the check bytes from rsEncode.
+// Return the number of data bytes, or "-1" if some codeword has more errors than the code corrects.
+// corrected is increased by the number of bytes fixed.
+int rsDecode(const RsCode *code, unsigned char *block, int size, int *corrected);
+
+// Erasure code over whole blocks: parity block row is the sum of coefficient(row, index) * block index.
+// Any nMissing lost blocks can be rebuilt from any nMissing parity blocks (Cauchy matrix).
+
+// Coefficient of data block index (below nData) in parity block row, nData + row must stay below 256.
+unsigned char rsErasureCoefficient(int row, int index, int nData);
+
+// dst += factor * src, size bytes over GF(256).
+void rsMulAdd(unsigned char *dst, const unsigned char *src, int size, unsigned char factor);
+
+// Rebuilds nMissing lost data blocks of size bytes into blocks, from the parity blocks rows with the contribution
+// of every data block still at hand already added in (syndromes).
+// Return "0" on success or "-1" on error.
+int rsSolveErasures(unsigned char **syndromes, const int *rows, const int *missing, int nMissing, int nData, int size,
+                    unsigned char **blocks);
+
+#endif // _REED_SOLOMON_H_
@@ -0,0 +1,53 @@
+// Lock-free single-producer/single-consumer ring header.
+
+#ifndef _SPSC_RING_H_
+#define _SPSC_RING_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define RING_SPINS 128 // backoff attempts before an end waiting on the other parks
+
+typedef struct
+{
+    unsigned char *slots;  // capacity * slotSize bytes
+    int slotSize;
+    unsigned int capacity; // power of two
+    atomic_uint head;      // next slot to consume
+    atomic_uint tail;      // next slot to produce
+    atomic_int closed;
+    int spins;             // backoff attempts before parking, RING_SPINS unless set after ringInit
+    atomic_int parked;     // ends waiting on wake, only then do the other end's calls take the lock
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} SpscRing;
+
+// Allocates capacity (rounded up to a power of two) slots of slotSize bytes.
+// Return "0" on success or "-1" on error.
+int ringInit(SpscRing *ring, unsigned int capacity, int slotSize);
+
+// Frees the slots and the lock. Both ends must be done with the ring.
+void ringFree(SpscRing *ring);
+
+// Producer: waits for a free slot to fill.
+// Return the slot, or NULL if the ring was closed.
+void *ringProducerSlot(SpscRing *ring);
+
+// Producer: hands the slot from ringProducerSlot over to the consumer.
+void ringPublish(SpscRing *ring);
+
+// Consumer: waits for a filled slot.
+// Return the slot, or NULL once the ring is closed and drained.
+void *ringConsumerSlot(SpscRing *ring);
+
+// Consumer: gives the slot from ringConsumerSlot back to the producer.
+void ringRelease(SpscRing *ring);
+
+// Waits a little longer each attempt: spins, then yields.
+// Return "0" once limit attempts were made and the caller should block instead, "1" otherwise.
+int ringSpin(int *attempt, int limit);
+
+// Either end: no more slots will be produced (the consumer still drains what is left) or consumed.
+void ringClose(SpscRing *ring);
+
+#endif // _SPSC_RING_H_
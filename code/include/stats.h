@@ -0,0 +1,79 @@
+// Transfer statistics header.
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+
+#define HISTOGRAM_SUB_BITS 4 // 16 buckets per power of two, values within 1/16 of their bucket
+#define HISTOGRAM_BUCKETS ((40 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) // up to 2^40 us
+#define GOODPUT_SLOTS 256
+#define GOODPUT_INTERVAL 100000 // us, first width of a goodput slot, doubled whenever the slots run out
+
+// Log-linear histogram of durations in microseconds, as HdrHistogram: recording is a couple of shifts and
+// an increment, the relative error is bounded by the bucket width.
+typedef struct
+{
+    long counts[HISTOGRAM_BUCKETS];
+    long count;
+    long long sum;
+    long long min;
+    long long max;
+} Histogram;
+
+// Payload bytes delivered per time slot since start.
+typedef struct
+{
+    long long start;    // us
+    long long interval; // us
+    long bytes[GOODPUT_SLOTS];
+    int used;           // slots up to the last one written
+} GoodputSeries;
+
+// Per link counters beyond the byte totals, kept by the link layer.
+typedef struct
+{
+    long long openedAt; // us
+    long framesSent;    // new I-frames
+    long framesReceived; // I-frames handed over in order
+    long retransmissions;
+    long timeouts;
+    long rejSent;
+    long rejReceived;
+    long srejSent;
+    long srejReceived;
+    long duplicates;    // I-frames received again after they were taken
+    long stuffedBytes;  // escapes added to I-frame bodies
+    Histogram rtt;      // first transmission to acknowledgement, frames sent once only (Karn)
+    Histogram ackLatency; // first transmission to acknowledgement, retransmissions included
+    Histogram retransmitDelay; // previous transmission to the next one of the same frame
+    GoodputSeries goodput;
+} LinkStats;
+
+// Microseconds on CLOCK_MONOTONIC.
+long long statsNow();
+
+void histogramRecord(Histogram *histogram, long long value);
+
+// Return the value at or below which percentile (0 to 100) of the recorded values are, or "0" if there are none.
+long long histogramPercentile(const Histogram *histogram, double percentile);
+
+// Writes the histogram as a JSON object: count, min, mean, max, percentiles and the non-empty buckets.
+void histogramJson(FILE *out, const Histogram *histogram);
+
+void goodputInit(GoodputSeries *series, long long start);
+void goodputRecord(GoodputSeries *series, long long now, long bytes);
+
+// Writes the series as a JSON object: slot width and bytes per second of each slot.
+void goodputJson(FILE *out, const GoodputSeries *series);
+
+void statsInit(LinkStats *stats);
+
+// Keeps the JSON object of one closed link for the next report, taking ownership of json (from malloc).
+void statsReportLink(char *json);
+
+// Writes the links kept so far with the transfer totals as one JSON document to path, and forgets them.
+// Return "0" on success or "-1" on error.
+int statsWriteReport(const char *path, const char *role, long bytes, double seconds);
+
+#endif // _STATS_H_
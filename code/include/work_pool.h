@@ -0,0 +1,53 @@
+// Ordered worker pool header.
+
+#ifndef _WORK_POOL_H_
+#define _WORK_POOL_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Fills slot with the result of job index.
+typedef void (*PoolJob)(void *context, long index, void *slot);
+
+// Runs nJobs independent jobs on several threads, at most capacity ahead of a single consumer,
+// which takes the results back in job order.
+typedef struct
+{
+    unsigned char *slots;  // capacity * slotSize bytes
+    int slotSize;
+    unsigned int capacity; // power of two
+    long nJobs;
+    PoolJob job;
+    void *context;
+    int nThreads;
+    pthread_t *threads;
+    atomic_long next;      // next job a worker claims
+    atomic_long consumed;  // results released by the consumer
+    atomic_long *done;     // per slot, index + 1 of the job whose result it holds
+    atomic_int closed;
+    atomic_int parkedWorkers;  // workers asleep on freed
+    atomic_int parkedConsumer; // consumer asleep on ready
+    pthread_mutex_t lock;
+    pthread_cond_t freed;  // the consumer released a slot
+    pthread_cond_t ready;  // a worker filled a slot
+} WorkPool;
+
+// Starts nThreads workers on jobs 0 to nJobs - 1, with capacity (rounded up to a power of two) result slots.
+// Return "0" on success or "-1" on error.
+int poolStart(WorkPool *pool, int nThreads, unsigned int capacity, int slotSize, long nJobs, PoolJob job,
+              void *context);
+
+// Consumer: waits for the result of the next job in order.
+// Return the slot, or NULL after the last job or once the pool is stopped.
+void *poolResult(WorkPool *pool);
+
+// Consumer: gives the slot from poolResult back to the workers.
+void poolRelease(WorkPool *pool);
+
+// Stops the workers, unfinished jobs are dropped, and frees the pool.
+void poolStop(WorkPool *pool);
+
+// Number of workers to run, one per online core.
+int poolDefaultThreads();
+
+#endif // _WORK_POOL_H_
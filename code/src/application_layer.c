@@ -2,36 +2,469 @@
 
 #include "application_layer.h"
 #include "link_layer.h"
+#include "lz.h"
+#include "spsc_ring.h"
+#include "stats.h"
+#include "work_pool.h"
+#include <dirent.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
 #include <string.h>
+#include <sys/mman.h>
 
-#define PACKET_SIZE 256
+#define PACKET_SIZE 256 // initial data packet size
+#define MIN_PACKET_SIZE 32
+#define MAX_PACKET_SIZE (llpayloadLimit() - 3)
+#define FRAME_OVERHEAD 10 // packet header, frame header, FCS and flag bytes per data packet
+#define PREFETCH_CHUNK (64 * 1024) // bytes faulted in per reader step
+#define PIPELINE_DEPTH 32 // frames encoded ahead of the line writer
+#define WRITE_BEHIND_DEPTH 256 // received packets that may wait for the disk
+#define CHUNK_SIZE (32 * 1024) // source bytes compressed together, independently of the rest
+#define CHUNK_HEADER 5
+#define MAX_DECODERS 16
 #define CONTROL_DATA 0x01
 #define CONTROL_START 0x02
 #define CONTROL_END 0x03
+#define CONTROL_END_BATCH 0x04
+#define CONTROL_RESUME 0x05
 #define FILE_SIZE_T 0x00
 #define FILE_NAME_T 0x01
+#define COMPRESSION_T 0x02
+#define BATCH_T 0x03
+#define FILE_ID_T 0x04
+#define CHECKPOINT_INTERVAL (256 * 1024) // received bytes between checkpoint updates
+#define CHECKPOINT_MAGIC "RSM1"
+#define CHECKPOINT_HEADER 28 // magic, file size, file id and offset
+#define COMPRESSION_NONE 0x00
+#define COMPRESSION_LZ 0x01
+#define CHUNK_STORED 0x00
+#define CHUNK_LZ 0x01
 
 extern int DEBUG;
 long globalFileSize = 0;
 
-int applicationWrite(const char *filename) {
-    FILE *file = fopen(filename, "r");
+int ADAPTIVE_PACKET_SIZE = TRUE;
+int PIPELINE = TRUE; // read, frame and write data packets on separate threads
+int COMPRESSION = COMPRESSION_LZ; // codec the sender offers in START, used only if the receiver takes it
+int compression = COMPRESSION_NONE; // codec of the current transfer
+int COMPRESSION_THREADS = 0; // compressors on the sender, decompressors on the receiver, 0 for one per core
+int RESUME = TRUE; // negotiate where to start files larger than CHECKPOINT_INTERVAL, the receiver keeps checkpoints
+const char* STATS_FILE_TX = "stats-tx.json"; // JSON report written at close, NULL for none
+const char* STATS_FILE_RX = "stats-rx.json";
+
+typedef struct
+{
+    long offset;
+    long size;
+} SourceChunk;
+
+int WRITE_BEHIND = TRUE; // write received packets to disk on a separate thread
+
+typedef struct
+{
+    long offset;
+    int size;
+    unsigned char packet[MAX_PAYLOAD_SIZE + MAX_FCS_SIZE];
+} ReceivedPacket;
+
+// Compressed transfers send a stream of chunk records, cut into data packets:
+// method / byte 1 of nº of file bytes / byte 2 of nº of file bytes / byte 1 of nº of bytes / byte 2 of nº of bytes / bytes...
+typedef struct
+{
+    long size;   // file bytes
+    int recordSize;
+    unsigned char record[CHUNK_HEADER + CHUNK_SIZE];
+} CompressedChunk;
+
+typedef struct
+{
+    long offset;
+    int method;      // CHUNK_STORED or CHUNK_LZ
+    int size;        // file bytes
+    int encodedSize;
+    int received;
+    unsigned char data[CHUNK_SIZE];
+} ReceivedChunk;
+
+// Receive side: llread fills pooled ring slots in place (or chunk records are gathered in them),
+// the writer threads put them in the file
+typedef struct
+{
+    int file;
+    SpscRing packets;
+    atomic_int failed;
+    atomic_long written; // end of the last data packet written, or nº of chunk records written
+} RxWriter;
+
+// Receive checkpoint, kept in <file>.resume while the file is incomplete:
+// magic / file size (8) / file id (8) / contiguous offset (8) / name
+// Everything before the offset has been written, a new transfer of the same file continues from there.
+typedef struct
+{
+    int file; // -1 when the transfer keeps none
+    long saved;
+} Checkpoint;
+
+// Transmit pipeline: reader -> chunks -> framer -> frames -> line writer (the calling thread)
+typedef struct
+{
+    const unsigned char *source;
+    long fileSize;
+    SpscRing chunks;
+    SpscRing frames;
+    WorkPool compressors;
+    long nChunks;
+    long framed; // source bytes the framer got through, read after it is joined
+} TxPipeline;
+
+// Picks the data packet size with the best expected efficiency L / (L + H) * (1 - p)^(8 (L + H)) for the line,
+// with the bit error rate p inferred from the frame error rate the link layer saw at the current size.
+int choosePacketSize(int current) {
+    if(!ADAPTIVE_PACKET_SIZE) return current;
+    double fer = llframeErrorRate();
+    if(fer < 1e-6) return MAX_PACKET_SIZE;
+    if(fer > 0.999) return MIN_PACKET_SIZE;
+
+    // -ln((1 - p)^8) from 1 - fer = (1 - p)^(8 (current + H))
+    double lossPerByte = -log1p(-fer) / (current + FRAME_OVERHEAD);
+    // root of d/dL ln(efficiency) = 1 / L - 1 / (L + H) - lossPerByte = 0
+    double best = (-FRAME_OVERHEAD + sqrt((double)FRAME_OVERHEAD * FRAME_OVERHEAD + 4 * FRAME_OVERHEAD / lossPerByte)) / 2;
+    if(best < MIN_PACKET_SIZE) return MIN_PACKET_SIZE;
+    if(best > MAX_PACKET_SIZE) return MAX_PACKET_SIZE;
+    return (int)best;
+}
+
+// Maps the whole file read-only for sequential access. Pipes and other unmappable inputs are read into memory instead.
+// Return the file contents, or NULL on error, setting size and whether it is mapped.
+unsigned char* openSource(const char *filename, long* size, int* mapped) {
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) return NULL;
+
+    struct stat st;
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        unsigned char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            *size = st.st_size;
+            *mapped = TRUE;
+            return data;
+        }
+    }
+
+    // streaming fallback, the START packet needs the size before any data is sent
+    long capacity = 64 * 1024;
+    long used = 0;
+    unsigned char* data = malloc(capacity);
+    int bytes;
+    while(data != NULL && (bytes = read(fd, data + used, capacity - used)) > 0) {
+        used += bytes;
+        if(used == capacity) {
+            capacity *= 2;
+            unsigned char* grown = realloc(data, capacity);
+            if(grown == NULL) free(data);
+            data = grown;
+        }
+    }
+    close(fd);
+    if(data == NULL || bytes < 0) {
+        free(data);
+        return NULL;
+    }
+    *size = used;
+    *mapped = FALSE;
+    return data;
+}
+
+void closeSource(unsigned char* data, long size, int mapped) {
+    if(mapped) munmap(data, size);
+    else free(data);
+}
+
+// Compresses chunk index of the source into a chunk record, stored as it is when it does not shrink.
+void compressChunk(const unsigned char* source, long fileSize, long index, CompressedChunk* chunk) {
+    long offset = index * CHUNK_SIZE;
+    int size = fileSize - offset < CHUNK_SIZE ? fileSize - offset : CHUNK_SIZE;
+    unsigned char* record = chunk->record;
+
+    int packed = lzCompress(source + offset, size, record + CHUNK_HEADER, size - 1);
+    if(packed < 0) {
+        memcpy(record + CHUNK_HEADER, source + offset, size);
+    }
+    int encodedSize = packed < 0 ? size : packed;
+    record[0] = packed < 0 ? CHUNK_STORED : CHUNK_LZ;
+    record[1] = (size >> 8) & 0xFF;
+    record[2] = size & 0xFF;
+    record[3] = (encodedSize >> 8) & 0xFF;
+    record[4] = encodedSize & 0xFF;
+    chunk->size = size;
+    chunk->recordSize = CHUNK_HEADER + encodedSize;
+}
+
+void compressorJob(void* context, long index, void* slot) {
+    TxPipeline* pipeline = context;
+    compressChunk(pipeline->source, pipeline->fileSize, index, slot);
+}
+
+long chunkCount(long fileSize) {
+    return (fileSize + CHUNK_SIZE - 1) / CHUNK_SIZE;
+}
+
+// Data Packet -> 0x01 / byte 1 of nº of bytes / byte 2 of nº of bytes / packets...
+// The header is framed together with the packet bytes straight from the source (or a chunk record),
+// packets never span two records.
+// The packet size follows the line quality, the receiver reads packets until END.
+// Return "0" on success or "1" on error.
+int sendPackets(const unsigned char* bytes, long size, int* packetSize, long* nPacket) {
+    unsigned char dataHeader[3];
+    dataHeader[0] = CONTROL_DATA;
+
+    for(long offset = 0; offset < size; (*nPacket)++) {
+        int packet = size - offset < *packetSize ? size - offset : *packetSize;
+        dataHeader[1] = (packet >> 8) & 0xFF;
+        dataHeader[2] = packet & 0xFF;
+        if(llwritePacket(dataHeader, 3, bytes + offset, packet) < 3 + packet) {
+            printf("Failed to send data packet\n");
+            return 1;
+        }
+        if(DEBUG) printf("Data packet %ld (%d bytes)\n", *nPacket, packet);
+        offset += packet;
+        *packetSize = choosePacketSize(*packetSize);
+    }
+    return 0;
+}
+
+int sendData(const unsigned char* source, long fileSize) {
+    int packetSize = PACKET_SIZE;
+    long nPacket = 0;
+    if(compression == COMPRESSION_NONE) return sendPackets(source, fileSize, &packetSize, &nPacket);
+
+    CompressedChunk* chunk = malloc(sizeof(CompressedChunk));
+    long sent = 0;
+    for(long index = 0; index < chunkCount(fileSize); index++) {
+        compressChunk(source, fileSize, index, chunk);
+        if(sendPackets(chunk->record, chunk->recordSize, &packetSize, &nPacket) != 0) {
+            free(chunk);
+            return 1;
+        }
+        sent += chunk->recordSize;
+    }
+    if(DEBUG) printf("Compressed %ld bytes into %ld\n", fileSize, sent);
+    free(chunk);
+    return 0;
+}
+
+// Reader stage: faults the source in a chunk at a time ahead of the framer.
+void* readerStage(void* arg) {
+    TxPipeline* pipeline = arg;
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    for(long offset = 0; offset < pipeline->fileSize; offset += PREFETCH_CHUNK) {
+        SourceChunk* chunk = ringProducerSlot(&pipeline->chunks);
+        if(chunk == NULL) break;
+        chunk->offset = offset;
+        chunk->size = pipeline->fileSize - offset < PREFETCH_CHUNK ? pipeline->fileSize - offset : PREFETCH_CHUNK;
+        volatile unsigned char sink = 0;
+        for(long i = 0; i < chunk->size; i += pageSize) {
+            sink ^= pipeline->source[offset + i];
+        }
+        (void)sink;
+        ringPublish(&pipeline->chunks);
+    }
+    ringClose(&pipeline->chunks);
+    return NULL;
+}
+
+// Framer stage: cuts the prefetched source into data packets and stuffs them into frames ahead of the window.
+void* framerStage(void* arg) {
+    TxPipeline* pipeline = arg;
+    unsigned char dataHeader[3];
+    dataHeader[0] = CONTROL_DATA;
+
+    long offset = 0;
+    long readyUntil = 0;
+    int packetSize = PACKET_SIZE;
+
+    while(offset < pipeline->fileSize) {
+        while(readyUntil < pipeline->fileSize && offset + packetSize > readyUntil) {
+            SourceChunk* chunk = ringConsumerSlot(&pipeline->chunks);
+            if(chunk == NULL) break;
+            readyUntil = chunk->offset + chunk->size;
+            ringRelease(&pipeline->chunks);
+        }
+
+        int size = pipeline->fileSize - offset < packetSize ? pipeline->fileSize - offset : packetSize;
+        EncodedFrame* frame = ringProducerSlot(&pipeline->frames);
+        if(frame == NULL) break; // the line writer gave up
+        dataHeader[1] = (size >> 8) & 0xFF;
+        dataHeader[2] = size & 0xFF;
+        if(llencode(dataHeader, 3, pipeline->source + offset, size, frame) != 0) break;
+        ringPublish(&pipeline->frames);
+        offset += size;
+        packetSize = choosePacketSize(packetSize);
+    }
+    pipeline->framed = offset;
+    ringClose(&pipeline->frames);
+    ringClose(&pipeline->chunks);
+    return NULL;
+}
+
+// Framer stage for compressed transfers: takes the chunk records in file order from the compressors
+// and cuts them into data packets, at the packet size the line calls for when they go out.
+void* chunkFramerStage(void* arg) {
+    TxPipeline* pipeline = arg;
+    unsigned char dataHeader[3];
+    dataHeader[0] = CONTROL_DATA;
+
+    int packetSize = PACKET_SIZE;
+    long sent = 0;
+    CompressedChunk* chunk;
+
+    while((chunk = poolResult(&pipeline->compressors)) != NULL) {
+        int offset = 0;
+        while(offset < chunk->recordSize) {
+            int size = chunk->recordSize - offset < packetSize ? chunk->recordSize - offset : packetSize;
+            EncodedFrame* frame = ringProducerSlot(&pipeline->frames);
+            if(frame == NULL) break; // the line writer gave up
+            dataHeader[1] = (size >> 8) & 0xFF;
+            dataHeader[2] = size & 0xFF;
+            if(llencode(dataHeader, 3, chunk->record + offset, size, frame) != 0) break;
+            ringPublish(&pipeline->frames);
+            offset += size;
+            packetSize = choosePacketSize(packetSize);
+        }
+        if(offset < chunk->recordSize) break;
+        pipeline->framed += chunk->size;
+        sent += chunk->recordSize;
+        poolRelease(&pipeline->compressors);
+    }
+    if(DEBUG) printf("Compressed %ld bytes into %ld\n", pipeline->framed, sent);
+    ringClose(&pipeline->frames);
+    return NULL;
+}
+
+// Same packets as sendData, but reading (or compressing, on a pool of threads) and framing run on their own
+// threads and overlap with the link waiting for acknowledgements, the calling thread only pushes ready frames.
+int sendDataPipelined(const unsigned char* source, long fileSize) {
+    TxPipeline pipeline;
+    pipeline.source = source;
+    pipeline.fileSize = fileSize;
+    pipeline.framed = 0;
+    pipeline.nChunks = chunkCount(fileSize);
+    int nCompressors = COMPRESSION_THREADS > 0 ? COMPRESSION_THREADS : poolDefaultThreads();
 
-    if(file == NULL) {
-        printf("Failed to open file\n");
+    if(ringInit(&pipeline.frames, PIPELINE_DEPTH, sizeof(EncodedFrame)) != 0 ||
+       (compression == COMPRESSION_NONE ? ringInit(&pipeline.chunks, 4, sizeof(SourceChunk)) :
+        poolStart(&pipeline.compressors, nCompressors, 2 * nCompressors, sizeof(CompressedChunk), pipeline.nChunks,
+                  compressorJob, &pipeline)) != 0) {
+        printf("Failed to allocate transmit pipeline\n");
         return 1;
     }
 
-    fseek(file, 0, SEEK_END);
+    pthread_t reader, framer;
+    if(compression == COMPRESSION_NONE) {
+        pthread_create(&reader, NULL, readerStage, &pipeline);
+        pthread_create(&framer, NULL, framerStage, &pipeline);
+    } else {
+        pthread_create(&framer, NULL, chunkFramerStage, &pipeline);
+    }
 
-    long fileSize = ftell(file);
-    globalFileSize = fileSize;
+    int result = 0;
+    long nPacket = 0;
+    EncodedFrame* frame;
+    while((frame = ringConsumerSlot(&pipeline.frames)) != NULL) {
+        int payloadSize = frame->payloadSize;
+        if(llwriteEncoded(frame) < payloadSize) {
+            printf("Failed to send data packet\n");
+            result = 1;
+            break;
+        }
+        ringRelease(&pipeline.frames);
+        if(DEBUG) printf("Data packet %ld (%d bytes)\n", nPacket++, payloadSize - 3);
+    }
+    ringClose(&pipeline.frames);
 
-    fseek(file, 0, SEEK_SET);
+    if(compression == COMPRESSION_NONE) {
+        pthread_join(reader, NULL);
+        pthread_join(framer, NULL);
+        ringFree(&pipeline.chunks);
+    } else {
+        pthread_join(framer, NULL);
+        poolStop(&pipeline.compressors);
+    }
+    ringFree(&pipeline.frames);
+
+    if(result == 0 && pipeline.framed != fileSize) {
+        printf("Failed to frame data packets\n");
+        result = 1;
+    }
+    return result;
+}
+
+// Waits for the receiver's answer to a START that offered to resume or to compress, once START is acknowledged.
+// Resume Packet -> 0x05 / size of offset / offset (/ 0x02 / 0x01 / compression taken)
+// Return the offset to send the file from, or "-1" on error, setting the codec the receiver took.
+long receiveResume(long fileSize, int* codec) {
+    unsigned char packet[MAX_PAYLOAD_SIZE + MAX_FCS_SIZE];
+    if(llflush() == -1) {
+        printf("Failed to send control packet\n");
+        return -1;
+    }
+    int bytes = llread(packet);
+    if(bytes < 2 || packet[0] != CONTROL_RESUME || packet[1] > 8 || bytes < 2 + packet[1]) {
+        printf("Invalid resume packet\n");
+        return -1;
+    }
+    long offset = 0;
+    for(int i = 0; i < packet[1]; i++) {
+        offset += (long)packet[2 + i] << (8 * i);
+    }
+    if(offset < 0 || offset > fileSize) {
+        printf("Invalid resume offset %ld\n", offset);
+        return -1;
+    }
+    // a receiver that does not say which codec it took only reads plain data packets
+    *codec = COMPRESSION_NONE;
+    int next = 2 + packet[1];
+    while(next + 2 <= bytes && next + 2 + packet[next + 1] <= bytes) {
+        if(packet[next] == COMPRESSION_T && packet[next + 1] == 1) *codec = packet[next + 2];
+        next += 2 + packet[next + 1];
+    }
+    return offset;
+}
+
+// Sends one file as START, data packets and END, under name (at most 255 bytes).
+// Files of a batch are marked in START, the receiver then waits for more after END.
+// Return "0" on success or "1" on error.
+int sendFile(const char *filename, const char *name, int batch) {
+    int nameSize = strlen(name);
+    if(nameSize > 0xFF) {
+        printf("File name too long: %s\n", name);
+        return 1;
+    }
+
+    long fileSize = 0;
+    int mapped = FALSE;
+    unsigned char* source = openSource(filename, &fileSize, &mapped);
+
+    if(source == NULL) {
+        printf("Failed to open file %s\n", filename);
+        return 1;
+    }
+
+    compression = COMPRESSION;
+
+    // files that can be told apart from a later version of themselves may be resumed
+    long fileId = 0;
+    struct stat st;
+    if(RESUME && fileSize > CHECKPOINT_INTERVAL && stat(filename, &st) == 0 && S_ISREG(st.st_mode)) {
+        fileId = (long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        fileId ^= (long)st.st_ino << 32;
+    }
 
-    long nPackets = ((fileSize + PACKET_SIZE) / PACKET_SIZE);
-    int nameSize = strlen(filename);
     // Control Packet -> 0x02 / 0x00 / size of fileSize / fileSize (/ 0x01 / size of filename/ filename)
+    // (/ 0x02 / 0x01 / compression) (/ 0x03 / 0x01 / 0x01 in a batch) (/ 0x04 / 0x08 / file id to resume)
     int fileSizeBytes = 0;
     long aux = fileSize;
     while(aux > 0) {
@@ -39,7 +472,8 @@ int applicationWrite(const char *filename) {
         fileSizeBytes++;
     }
 
-    unsigned char* controlPacket = malloc(5 + fileSizeBytes + nameSize);
+    int controlSize = 5 + fileSizeBytes + nameSize;
+    unsigned char* controlPacket = malloc(controlSize + 16);
     controlPacket[0] = CONTROL_START;
     controlPacket[1] = FILE_SIZE_T;
     controlPacket[2] = fileSizeBytes;
@@ -52,87 +486,517 @@ int applicationWrite(const char *filename) {
     controlPacket[fileSizeBytes + 3] = FILE_NAME_T;
     controlPacket[fileSizeBytes + 4] = nameSize;
     for(int i = 0; i < nameSize; i++) {
-        controlPacket[fileSizeBytes + 5 + i] = filename[i];
+        controlPacket[fileSizeBytes + 5 + i] = name[i];
+    }
+    if(compression != COMPRESSION_NONE) {
+        controlPacket[controlSize++] = COMPRESSION_T;
+        controlPacket[controlSize++] = 1;
+        controlPacket[controlSize++] = compression;
+    }
+    if(batch) {
+        controlPacket[controlSize++] = BATCH_T;
+        controlPacket[controlSize++] = 1;
+        controlPacket[controlSize++] = TRUE;
+    }
+    if(fileId != 0) {
+        controlPacket[controlSize++] = FILE_ID_T;
+        controlPacket[controlSize++] = 8;
+        for(int i = 0; i < 8; i++) {
+            controlPacket[controlSize++] = (fileId >> (8 * i)) & 0xFF;
+        }
     }
     
     if(DEBUG){
         printf("Printing control packet:\n");
-        for(int i = 0; i < 5 + fileSizeBytes + nameSize; i++) {
+        for(int i = 0; i < controlSize; i++) {
             printf("0x%x ", controlPacket[i]);
         }
         printf("\n");  
     }
-    if(llwrite(controlPacket, 5 + fileSizeBytes + nameSize) < 5 + fileSizeBytes + nameSize) {
+    if(llwrite(controlPacket, controlSize) < controlSize) {
         printf("Failed to send control packet\n");
+        closeSource(source, fileSize, mapped);
+        free(controlPacket);
         return 1;
     }
 
+    // the receiver answers with where to start and whether it takes the codec, it may decline it
+    int codec = COMPRESSION_NONE;
+    long resume = fileId != 0 || compression != COMPRESSION_NONE ? receiveResume(fileSize, &codec) : 0;
+    if(resume >= 0 && codec != COMPRESSION_NONE && codec != compression) {
+        printf("Invalid resume packet: Compression 0x%x was not offered\n", codec);
+        resume = -1;
+    }
+    if(resume < 0) {
+        closeSource(source, fileSize, mapped);
+        free(controlPacket);
+        return 1;
+    }
+    if(codec != compression && DEBUG) printf("Compression declined, sending plain data packets\n");
+    compression = codec;
+    if(resume > 0) printf("Resuming %s at byte %ld\n", name, resume);
+    globalFileSize += fileSize - resume;
+
     controlPacket[0] = CONTROL_END;
 //------------------------------------------------------
     
-    // Data Packet -> 0x01 / byte 1 of nº of bytes / byte 2 of nº of bytes / packets...
-    unsigned char dataPacket [PACKET_SIZE + 3];
+    // small files are not worth starting the pipeline threads for
+    int pipelined = PIPELINE && fileSize - resume > PREFETCH_CHUNK;
+    if((pipelined ? sendDataPipelined(source + resume, fileSize - resume) :
+        sendData(source + resume, fileSize - resume)) != 0) {
+        closeSource(source, fileSize, mapped);
+        free(controlPacket);
+        return 1;
+    }
     
-    dataPacket[0] = CONTROL_DATA;
-    dataPacket[1] = (PACKET_SIZE >> 8) & 0xFF;
-    dataPacket[2] = PACKET_SIZE & 0xFF;
+    if(llwrite(controlPacket, controlSize) < controlSize) {
+            printf("Failed to send control packet\n");
+            closeSource(source, fileSize, mapped);
+            free(controlPacket);
+            return 1;
+    }
+    closeSource(source, fileSize, mapped);
+    free(controlPacket);
+    return 0;
+}
 
-    long nPacket = 0;
+// Sends the files at paths one after the other, named by their last path component, then the end of the batch.
+// Return "0" on success or "1" on error.
+int sendBatch(char **paths, int nPaths) {
+    for(int i = 0; i < nPaths; i++) {
+        const char* name = strrchr(paths[i], '/');
+        name = name == NULL ? paths[i] : name + 1;
+        if(DEBUG) printf("Sending %s (%d of %d)\n", paths[i], i + 1, nPaths);
+        if(sendFile(paths[i], name, TRUE) != 0) return 1;
+    }
 
-    while(nPackets--) {
-        for(int i = 0; i < PACKET_SIZE; i++) {
-            int byte = fgetc(file);
-            dataPacket[3 + i] = (unsigned char) byte;
-            if(byte == EOF) {
-                dataPacket[1] = (i >> 8) & 0xFF;
-                dataPacket[2] = i & 0xFF;
-                if(llwrite(dataPacket, 3 + i) < 3 + i) {
-                    printf("Failed to send data packet\n");
-                    return 1;
-                }
-                if(llwrite(controlPacket, 5 + fileSizeBytes + nameSize) < 5 + fileSizeBytes + nameSize) {
-                    printf("Failed to send control packet\n");
-                    return 1;
-                }
-                free(controlPacket);
-                fclose(file);
-                return 0;
+    // End of batch Control Packet -> 0x04
+    unsigned char endBatch = CONTROL_END_BATCH;
+    if(llwrite(&endBatch, 1) < 1) {
+        printf("Failed to send control packet\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Lists the regular files of a directory (sorted by name), or the paths in a list file, one per line.
+// Return the number of paths, or "-1" on error.
+int listBatch(const char *source, int isDirectory, char ***paths) {
+    int nPaths = 0;
+    int capacity = 16;
+    *paths = malloc(capacity * sizeof(char*));
+
+    if(isDirectory) {
+        struct dirent **entries;
+        int nEntries = scandir(source, &entries, NULL, alphasort);
+        if(nEntries < 0) return -1;
+        for(int i = 0; i < nEntries; i++) {
+            char* path = malloc(strlen(source) + strlen(entries[i]->d_name) + 2);
+            sprintf(path, "%s/%s", source, entries[i]->d_name);
+            struct stat st;
+            if(stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+                if(nPaths == capacity) *paths = realloc(*paths, (capacity *= 2) * sizeof(char*));
+                (*paths)[nPaths++] = path;
+            } else {
+                free(path);
             }
+            free(entries[i]);
         }
-        if(llwrite(dataPacket, PACKET_SIZE + 3) < PACKET_SIZE + 3) {
-            printf("Failed to send data packet\n");
-            return 1;
-        }
-        if(DEBUG) printf("Data packet %ld \n", nPacket);
+        free(entries);
+        return nPaths;
+    }
 
-        nPacket++;
+    FILE* list = fopen(source, "r");
+    if(list == NULL) return -1;
+    char* line = NULL;
+    size_t lineSize = 0;
+    ssize_t length;
+    while((length = getline(&line, &lineSize, list)) > 0) {
+        while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = '\0';
+        if(length == 0) continue;
+        if(nPaths == capacity) *paths = realloc(*paths, (capacity *= 2) * sizeof(char*));
+        (*paths)[nPaths++] = strdup(line);
     }
-    
-    if(llwrite(controlPacket, 5 + fileSizeBytes + nameSize) < 5 + fileSizeBytes + nameSize) {
-            printf("Failed to send control packet\n");
-            return 1;
+    free(line);
+    fclose(list);
+    return nPaths;
+}
+
+// Sends filename, or in batch mode every file of a directory or every path listed in "@listfile".
+int applicationWrite(const char *filename) {
+    struct stat st;
+    int isDirectory = stat(filename, &st) == 0 && S_ISDIR(st.st_mode);
+    if(!isDirectory && filename[0] != '@') {
+        return sendFile(filename, filename, FALSE);
     }
-    fclose(file);
-    free(controlPacket);
+
+    char** paths;
+    int nPaths = listBatch(isDirectory ? filename : filename + 1, isDirectory, &paths);
+    if(nPaths < 0) {
+        printf("Failed to list batch %s\n", filename);
+        free(paths);
+        return 1;
+    }
+    int result = sendBatch(paths, nPaths);
+    for(int i = 0; i < nPaths; i++) free(paths[i]);
+    free(paths);
+    return result;
+}
+
+void putLong(unsigned char* bytes, long value) {
+    for(int i = 0; i < 8; i++) {
+        bytes[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+long getLong(const unsigned char* bytes) {
+    long value = 0;
+    for(int i = 0; i < 8; i++) {
+        value += (long)bytes[i] << (8 * i);
+    }
+    return value;
+}
+
+// Opens the checkpoint of the file at path for a transfer of name, fileSize bytes long, with the sender's file id.
+// One left by an earlier transfer of the same file sets where this one resumes, any other is started over.
+// Return "0" on success or "1" on error, setting the offset to resume from.
+int openCheckpoint(Checkpoint* checkpoint, const char* path, const char* name, long fileSize, long fileId, long* resume) {
+    int nameSize = strlen(name);
+    unsigned char header[CHECKPOINT_HEADER + 0x100];
+    char* checkpointPath = malloc(strlen(path) + 8);
+    sprintf(checkpointPath, "%s.resume", path);
+    checkpoint->file = open(checkpointPath, O_RDWR | O_CREAT, 0644);
+    checkpoint->saved = 0;
+    free(checkpointPath);
+    *resume = 0;
+    if(checkpoint->file < 0) return 1;
+
+    struct stat st;
+    int bytes = pread(checkpoint->file, header, sizeof(header), 0);
+    if(bytes == CHECKPOINT_HEADER + nameSize && memcmp(header, CHECKPOINT_MAGIC, 4) == 0 &&
+       getLong(header + 4) == fileSize && getLong(header + 12) == fileId &&
+       memcmp(header + CHECKPOINT_HEADER, name, nameSize) == 0 && stat(path, &st) == 0) {
+        long offset = getLong(header + 20);
+        if(offset > 0 && offset <= fileSize && offset <= st.st_size) *resume = offset;
+    }
+
+    memcpy(header, CHECKPOINT_MAGIC, 4);
+    putLong(header + 4, fileSize);
+    putLong(header + 12, fileId);
+    putLong(header + 20, *resume);
+    memcpy(header + CHECKPOINT_HEADER, name, nameSize);
+    if(pwrite(checkpoint->file, header, CHECKPOINT_HEADER + nameSize, 0) != CHECKPOINT_HEADER + nameSize ||
+       ftruncate(checkpoint->file, CHECKPOINT_HEADER + nameSize) != 0) {
+        close(checkpoint->file);
+        checkpoint->file = -1;
+        return 1;
+    }
+    checkpoint->saved = *resume;
     return 0;
 }
 
-int applicationRead(const char *filename) {
-    FILE *file = fopen(filename, "w");
+// Records that every byte before offset is in the file. Only the offset is rewritten, in place, so a transfer
+// killed at any point leaves a checkpoint that is valid. It is not synced: it outlives the process, not the machine.
+void saveCheckpoint(Checkpoint* checkpoint, long offset) {
+    if(checkpoint->file < 0 || offset <= checkpoint->saved) return;
+    unsigned char bytes[8];
+    putLong(bytes, offset);
+    if(pwrite(checkpoint->file, bytes, 8, 20) == 8) {
+        checkpoint->saved = offset;
+        if(DEBUG) printf("Checkpoint at byte %ld\n", offset);
+    }
+}
+
+// Closes the checkpoint of the file at path, removing it once the file is complete.
+void closeCheckpoint(Checkpoint* checkpoint, const char* path, int complete) {
+    if(checkpoint->file < 0) return;
+    close(checkpoint->file);
+    checkpoint->file = -1;
+    if(complete) {
+        char* checkpointPath = malloc(strlen(path) + 8);
+        sprintf(checkpointPath, "%s.resume", path);
+        unlink(checkpointPath);
+        free(checkpointPath);
+    }
+}
 
-    if(file == NULL) {
-        printf("Failed to open file\n");
+// Answers a START that offered to resume or to compress with the offset to send from and the codec taken,
+// and waits for it to be acknowledged.
+// Return "0" on success or "1" on error.
+int sendResume(long offset, int codec) {
+    unsigned char packet[13];
+    packet[0] = CONTROL_RESUME;
+    packet[1] = 8;
+    putLong(packet + 2, offset);
+    packet[10] = COMPRESSION_T;
+    packet[11] = 1;
+    packet[12] = codec;
+    if(llwrite(packet, 13) < 13 || llflush() == -1) {
+        printf("Failed to send resume packet\n");
         return 1;
     }
+    return 0;
+}
+
+// Offset below which every chunk record is in the file, the records of a transfer from base go round-robin
+// to the writers and all but the last are CHUNK_SIZE long.
+long chunksWritten(RxWriter* writers, int nWriters, long base, long fileSize) {
+    long first = -1;
+    for(int i = 0; i < nWriters; i++) {
+        long next = i + atomic_load(&writers[i].written) * nWriters;
+        if(first < 0 || next < first) first = next;
+    }
+    long offset = base + first * CHUNK_SIZE;
+    return offset < fileSize ? offset : fileSize;
+}
+
+// Expands a received chunk record if needed and writes it at its offset in the file.
+// Return "0" on success or "1" on error.
+int storeChunk(int file, const ReceivedChunk* chunk) {
+    const unsigned char* data = chunk->data;
+    unsigned char unpacked[CHUNK_SIZE];
+
+    if(chunk->method == CHUNK_LZ) {
+        if(lzDecompress(chunk->data, chunk->encodedSize, unpacked, chunk->size) != chunk->size) return 1;
+        data = unpacked;
+    }
+    return pwrite(file, data, chunk->size, chunk->offset) != chunk->size;
+}
+
+// Writer stage: puts received data packets (or expanded chunk records) in place in the file,
+// away from the receive and acknowledge loop.
+void* writerStage(void* arg) {
+    RxWriter* writer = arg;
+    void* slot;
+    while((slot = ringConsumerSlot(&writer->packets)) != NULL) {
+        ReceivedPacket* received = slot;
+        int failed = compression == COMPRESSION_NONE ?
+            pwrite(writer->file, received->packet + 3, received->size, received->offset) != received->size :
+            storeChunk(writer->file, slot) != 0;
+        if(failed) {
+            atomic_store(&writer->failed, TRUE);
+        } else if(!atomic_load(&writer->failed)) {
+            if(compression == COMPRESSION_NONE) atomic_store(&writer->written, received->offset + received->size);
+            else atomic_fetch_add(&writer->written, 1);
+        }
+        ringRelease(&writer->packets);
+    }
+    return NULL;
+}
+
+// Receives data packets, of any size, from offset until the END control packet, which is copied to controlPacket.
+// The bytes in the file so far are recorded in checkpoint as they go.
+// Return the size of the END packet, or "-1" on error.
+int receiveData(int file, long fileSize, long offset, Checkpoint* checkpoint, unsigned char* controlPacket) {
+    RxWriter writer;
+    pthread_t thread;
+    ReceivedPacket local;
+    // small files are not worth starting the writer thread for
+    int writeBehind = WRITE_BEHIND && fileSize > PREFETCH_CHUNK;
+
+    if(writeBehind) {
+        if(ringInit(&writer.packets, WRITE_BEHIND_DEPTH, sizeof(ReceivedPacket)) != 0) {
+            printf("Failed to allocate receive buffers\n");
+            return -1;
+        }
+        // packets come at the pace of the line, waiting on them is better done asleep than spinning
+        writer.packets.spins = 0;
+        writer.file = file;
+        atomic_init(&writer.failed, FALSE);
+        atomic_init(&writer.written, offset);
+        pthread_create(&thread, NULL, writerStage, &writer);
+    }
+
+    long nextCheckpoint = offset + CHECKPOINT_INTERVAL;
+    long nPacket = 0;
+    int result = -1;
+
+    while(TRUE) {
+        ReceivedPacket* received = writeBehind ? ringProducerSlot(&writer.packets) : &local;
+        int bytes = llread(received->packet);
+
+        if(bytes < 1 || received->packet[0] != CONTROL_DATA) {
+            if(bytes < 7) {
+                printf("Failed to receive control packet\n");
+                break;
+            }
+            memcpy(controlPacket, received->packet, bytes);
+            result = bytes;
+            break;
+        }
+        received->size = bytes < 3 ? 0 : (received->packet[1] << 8) + received->packet[2];
+        if(bytes < 3 || 3 + received->size > bytes) {
+            printf("Failed to receive data packet\n");
+            break;
+        }
+        received->offset = offset;
+        if(DEBUG) printf("Data packet %ld (%d bytes)\n", nPacket++, received->size);
+
+        if(offset + received->size > fileSize) {
+            printf("Data packet past the end of the file\n");
+            break;
+        }
+
+        if(writeBehind) {
+            ringPublish(&writer.packets);
+        } else if(pwrite(file, received->packet + 3, received->size, received->offset) != received->size) {
+            printf("Failed to write data packet\n");
+            break;
+        }
+        offset += received->size;
+
+        if(offset >= nextCheckpoint) {
+            saveCheckpoint(checkpoint, writeBehind ? atomic_load(&writer.written) : offset);
+            nextCheckpoint = offset + CHECKPOINT_INTERVAL;
+        }
+    }
+
+    if(writeBehind) {
+        ringClose(&writer.packets);
+        pthread_join(thread, NULL);
+        ringFree(&writer.packets);
+        if(atomic_load(&writer.failed)) {
+            printf("Failed to write data packet\n");
+            result = -1;
+        }
+    }
+    saveCheckpoint(checkpoint, writeBehind ? atomic_load(&writer.written) : offset);
+
+    if(result != -1 && offset != fileSize) {
+        printf("Received %ld of %ld bytes\n", offset, fileSize);
+        result = -1;
+    }
+    return result;
+}
+
+// Receives the chunk records of a compressed transfer from offset until the END control packet, which is copied to
+// controlPacket. Whole records go round-robin to a pool of writers that expand them in parallel.
+// The bytes in the file so far are recorded in checkpoint as they go.
+// Return the size of the END packet, or "-1" on error.
+int receiveChunks(int file, long fileSize, long offset, Checkpoint* checkpoint, unsigned char* controlPacket) {
+    RxWriter writers[MAX_DECODERS];
+    pthread_t threads[MAX_DECODERS];
+    int nWriters = 0;
+    ReceivedChunk* local = NULL;
+
+    if(WRITE_BEHIND && fileSize > PREFETCH_CHUNK) {
+        int wanted = COMPRESSION_THREADS > 0 ? COMPRESSION_THREADS : poolDefaultThreads();
+        if(wanted > MAX_DECODERS) wanted = MAX_DECODERS;
+        while(nWriters < wanted && ringInit(&writers[nWriters].packets, 2, sizeof(ReceivedChunk)) == 0) {
+            writers[nWriters].packets.spins = 0;
+            writers[nWriters].file = file;
+            atomic_init(&writers[nWriters].failed, FALSE);
+            atomic_init(&writers[nWriters].written, 0);
+            pthread_create(&threads[nWriters], NULL, writerStage, &writers[nWriters]);
+            nWriters++;
+        }
+    }
+    if(nWriters == 0 && (local = malloc(sizeof(ReceivedChunk))) == NULL) {
+        printf("Failed to allocate receive buffers\n");
+        return -1;
+    }
 
-    unsigned char controlPacket[517] = {0}; // 5 + 2⁸ * 2
+    unsigned char packet[MAX_PAYLOAD_SIZE + MAX_FCS_SIZE];
+    ReceivedChunk* chunk = NULL;
+    long nChunk = 0;
+    long nPacket = 0;
+    long base = offset;
+    long nextCheckpoint = offset + CHECKPOINT_INTERVAL;
+    int result = -1;
 
-    int bytes = llread(controlPacket);
-    if(bytes < 7) {
-        printf("Failed to receive control packet\n");
-        return 1;   
+    while(TRUE) {
+        int bytes = llread(packet);
+
+        if(bytes < 1 || packet[0] != CONTROL_DATA) {
+            if(bytes < 7 || chunk != NULL) {
+                printf("Failed to receive control packet\n");
+                break;
+            }
+            memcpy(controlPacket, packet, bytes);
+            result = bytes;
+            break;
+        }
+
+        int size = bytes < 3 ? 0 : (packet[1] << 8) + packet[2];
+        if(bytes < 3 || 3 + size > bytes) {
+            printf("Failed to receive data packet\n");
+            break;
+        }
+        if(DEBUG) printf("Data packet %ld (%d bytes)\n", nPacket++, size);
+        const unsigned char* data = packet + 3;
+
+        // a record starts a packet, its header tells how many more bytes to gather
+        if(chunk == NULL) {
+            if(size < CHUNK_HEADER) {
+                printf("Invalid chunk record\n");
+                break;
+            }
+            chunk = nWriters > 0 ? ringProducerSlot(&writers[nChunk % nWriters].packets) : local;
+            chunk->method = data[0];
+            chunk->size = (data[1] << 8) + data[2];
+            chunk->encodedSize = (data[3] << 8) + data[4];
+            chunk->received = 0;
+            chunk->offset = offset;
+            data += CHUNK_HEADER;
+            size -= CHUNK_HEADER;
+
+            if(chunk->size < 1 || chunk->size > CHUNK_SIZE || chunk->encodedSize > chunk->size ||
+               (chunk->method == CHUNK_STORED && chunk->encodedSize != chunk->size) ||
+               (chunk->method != CHUNK_STORED && chunk->method != CHUNK_LZ) || offset + chunk->size > fileSize ||
+               (chunk->size != CHUNK_SIZE && offset + chunk->size != fileSize)) {
+                printf("Invalid chunk record\n");
+                break;
+            }
+        }
+        if(chunk->received + size > chunk->encodedSize) {
+            printf("Invalid chunk record\n");
+            break;
+        }
+        memcpy(chunk->data + chunk->received, data, size);
+        chunk->received += size;
+
+        if(chunk->received == chunk->encodedSize) {
+            if(nWriters > 0) {
+                ringPublish(&writers[nChunk % nWriters].packets);
+            } else if(storeChunk(file, chunk) != 0) {
+                printf("Failed to write data packet\n");
+                break;
+            }
+            offset += chunk->size;
+            nChunk++;
+            chunk = NULL;
+        }
+
+        if(offset >= nextCheckpoint) {
+            saveCheckpoint(checkpoint, nWriters > 0 ? chunksWritten(writers, nWriters, base, fileSize) : offset);
+            nextCheckpoint = offset + CHECKPOINT_INTERVAL;
+        }
+    }
+
+    for(int i = 0; i < nWriters; i++) {
+        ringClose(&writers[i].packets);
+        pthread_join(threads[i], NULL);
+        ringFree(&writers[i].packets);
+        if(atomic_load(&writers[i].failed) && result != -1) {
+            printf("Failed to write data packet\n");
+            result = -1;
+        }
+    }
+    saveCheckpoint(checkpoint, nWriters > 0 ? chunksWritten(writers, nWriters, base, fileSize) : offset);
+    free(local);
+
+    if(result != -1 && offset != fileSize) {
+        printf("Received %ld of %ld bytes\n", offset, fileSize);
+        result = -1;
     }
+    return result;
+}
 
+// Receives one file, from its START control packet (bytes long, in controlPacket) to its END, into filename.
+// Files of a batch go into the directory filename instead, under the last path component of the name they were sent
+// with.
+// Return "0" on success or "1" on error, setting whether the file is part of a batch.
+int receiveFile(const char *filename, unsigned char* controlPacket, int bytes, int* batch) {
     if(DEBUG){
         printf("Printing control packet:\n");
         for(int i = 0; i < bytes; i++) {
@@ -153,10 +1017,9 @@ int applicationRead(const char *filename) {
     }
 
     for(int i = 0; i < controlPacket[2]; i++) {
-        fileSize += (controlPacket[3 + i] << (8*i));
+        fileSize += ((long)controlPacket[3 + i] << (8*i));
     }
     if(DEBUG) printf("filesize: %ld\n",fileSize);
-    globalFileSize = fileSize;
 
     if(controlPacket[3 + controlPacket[2]] != FILE_NAME_T) {
         printf("Invalid control packet: File name type was 0x%x\n", controlPacket[3 + controlPacket[2]]);
@@ -164,87 +1027,166 @@ int applicationRead(const char *filename) {
     }
 
     int nameSize = controlPacket[4 + controlPacket[2]];
-    char* name = malloc(nameSize);
+    char* name = malloc(nameSize + 1);
     for(int i = 0; i < nameSize; i++) {
         name[i] = controlPacket[5 + controlPacket[2] + i];
     }
-    
-    long nPackets = ((fileSize + PACKET_SIZE) / PACKET_SIZE);
-    long aux = nPackets;
-    if(DEBUG) printf("nPackets: %ld\n", nPackets);
+    name[nameSize] = '\0';
 
-    unsigned char dataPacket [PACKET_SIZE + 3 +1]; 
-    
-    while(nPackets--) {
-        if(llread(dataPacket) < 3) {
-            
-            printf("Failed to receive data packet\n");
-            return 1;
+    // optional parameters, data packets are stored as they are without compression
+    compression = COMPRESSION_NONE;
+    int compressionOffered = FALSE;
+    *batch = FALSE;
+    long fileId = 0;
+    int next = 5 + controlPacket[2] + nameSize;
+    while(next + 2 <= bytes && next + 2 + controlPacket[next + 1] <= bytes) {
+        if(controlPacket[next] == COMPRESSION_T && controlPacket[next + 1] == 1) {
+            // a codec this end does not know is declined, the sender falls back to plain data packets
+            compressionOffered = TRUE;
+            compression = controlPacket[next + 2] == COMPRESSION_LZ ? COMPRESSION_LZ : COMPRESSION_NONE;
+            if(DEBUG) printf("compression: 0x%x offered, 0x%x taken\n", controlPacket[next + 2], compression);
         }
+        if(controlPacket[next] == BATCH_T && controlPacket[next + 1] == 1) {
+            *batch = controlPacket[next + 2];
+        }
+        if(controlPacket[next] == FILE_ID_T && controlPacket[next + 1] == 8) {
+            fileId = getLong(&controlPacket[next + 2]);
+        }
+        next += 2 + controlPacket[next + 1];
+    }
 
-        if(dataPacket[0] != CONTROL_DATA) {
-            printf("Invalid data packet, byte 0:%x\n", dataPacket[0]);
+    char* path = strdup(filename);
+    if(*batch) {
+        // only the last component, the sender cannot write outside the directory
+        const char* base = strrchr(name, '/');
+        base = base == NULL ? name : base + 1;
+        if(base[0] == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+            printf("Invalid file name %s\n", name);
+            free(name);
+            free(path);
             return 1;
         }
-        int packetSize = (dataPacket[1] << 8) + dataPacket[2];
-        
-        if(DEBUG) printf("Data packet %ld\n", aux - nPackets - 1);
+        if(mkdir(filename, 0755) != 0 && errno != EEXIST) {
+            perror(filename);
+            free(name);
+            free(path);
+            return 1;
+        }
+        free(path);
+        path = malloc(strlen(filename) + strlen(base) + 2);
+        sprintf(path, "%s/%s", filename, base);
+    }
 
-        fwrite(dataPacket + 3, 1, packetSize, file);
-        
+    // the sender offered to resume, it waits to hear from where
+    Checkpoint checkpoint = {-1, 0};
+    long resume = 0;
+    if(fileId != 0 && openCheckpoint(&checkpoint, path, name, fileSize, fileId, &resume) != 0) {
+        if(DEBUG) printf("Could not keep a checkpoint for %s\n", path);
     }
 
-    memset(controlPacket, 0, 517);
+    int file = open(path, resume > 0 ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-    if(llread(controlPacket) < 7) {
-        printf("Failed to receive control packet\n");
+    if(file < 0) {
+        printf("Failed to open file %s\n", path);
+        closeCheckpoint(&checkpoint, path, FALSE);
+        free(name);
+        free(path);
         return 1;
     }
 
+    // reserve the whole file up front so it is laid out in one piece, packets then land at their offsets
+    if(fileSize > 0 && posix_fallocate(file, 0, fileSize) != 0) {
+        if(DEBUG) printf("Could not preallocate %ld bytes\n", fileSize);
+    }
+
+    int result = 1;
+    if((fileId != 0 || compressionOffered) && sendResume(resume, compression) != 0) {
+        goto done;
+    }
+    if(resume > 0) printf("Resuming %s at byte %ld\n", path, resume);
+    globalFileSize += fileSize - resume;
+
+    memset(controlPacket, 0, MAX_PAYLOAD_SIZE + MAX_FCS_SIZE);
+    if((compression == COMPRESSION_NONE ? receiveData : receiveChunks)(file, fileSize, resume, &checkpoint,
+                                                                       controlPacket) == -1) {
+        goto done;
+    }
+
     if(controlPacket[0] != CONTROL_END) {
         printf("Invalid control packet. End was 0x%x\n", controlPacket[0]);
-        return 1;
+        goto done;
     }
 
     if(controlPacket[1] != FILE_SIZE_T) {
         printf("Invalid control packet- File size t was 0x%x\n", controlPacket[1]);
-        return 1;
+        goto done;
     }
 
     long fileSize2 = 0;
     for(int i = 0; i < controlPacket[2]; i++) {
-        fileSize2 += (controlPacket[3 + i] << (8*i));
+        fileSize2 += ((long)controlPacket[3 + i] << (8*i));
     }
 
     if(fileSize != fileSize2) {
         printf("FileSize does not match\n");
-        return 1;
+        goto done;
     }
 
     if(controlPacket[3 + controlPacket[2]] != FILE_NAME_T) {
         printf("Invalid control packet\n");
-        return 1;
+        goto done;
     }
 
     int nameSize2 = controlPacket[4 + controlPacket[2]];
 
     if(nameSize != nameSize2) {
         printf("NameSize does not match\n");
-        return 1;
+        goto done;
     }
 
     for(int i = 0; i < nameSize; i++) {
         if(name[i] != controlPacket[5 + controlPacket[2] + i]) {
             printf("Name does not match\n");
-            return 1;
+            goto done;
         }
     }
 
-    if(DEBUG) printf("\nFile with name %s and size %ld received and named %s\n", name, fileSize, filename);
+    if(DEBUG) printf("\nFile with name %s and size %ld received and named %s\n", name, fileSize, path);
 
-    fclose(file);
+    if(fdatasync(file) != 0) {
+        perror("fdatasync");
+    }
+    result = 0;
 
+done:
+    close(file);
+    closeCheckpoint(&checkpoint, path, result == 0);
     free(name);
+    free(path);
+    return result;
+}
+
+// Receives a file into filename, or a whole batch into the directory filename, until the end of the batch.
+int applicationRead(const char *filename) {
+    unsigned char controlPacket[MAX_PAYLOAD_SIZE + MAX_FCS_SIZE] = {0}; // at least 5 + 2⁸ * 2
+    long nFiles = 0;
+    int batch = FALSE;
+
+    do {
+        int bytes = llread(controlPacket);
+        if(bytes >= 1 && controlPacket[0] == CONTROL_END_BATCH) {
+            if(DEBUG) printf("End of batch, %ld files received\n", nFiles);
+            return 0;
+        }
+        if(bytes < 7) {
+            printf("Failed to receive control packet\n");
+            return 1;   
+        }
+        if(receiveFile(filename, controlPacket, bytes, &batch) != 0) {
+            return 1;
+        }
+        nFiles++;
+    } while(batch);
 
     return 0;
 }
@@ -254,6 +1196,10 @@ int applicationRead(const char *filename) {
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
                       int nTries, int timeout, const char *filename) {
     LinkLayer connectionParameters;
+    if(strlen(serialPort) >= sizeof(connectionParameters.serialPort)) {
+        printf("Serial port name too long\n");
+        return;
+    }
     strcpy(connectionParameters.serialPort, serialPort);
     if(strcmp(role, "rx") == 0)
         connectionParameters.role = LlRx;
@@ -264,16 +1210,19 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
     connectionParameters.nRetransmissions = nTries;
     connectionParameters.timeout = timeout;
 
+    globalFileSize = 0;
     if(llopen(connectionParameters)) {
         printf("Failed to open connection\n");
         return;
     }
 
-    clock_t start = clock();
+    long long start = statsNow();
     
     switch (connectionParameters.role) {
         case LlTx:
             applicationWrite(filename);
+            // llwrite does not wait for acknowledgements, the transfer is over once the last window is
+            if(llflush() == -1) printf("Failed to send the last packets\n");
             break;
         
         case LlRx:
@@ -284,17 +1233,22 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
             break;
     }
 
-    clock_t end = clock();
+    double seconds = (statsNow() - start) / 1e6;
 
     if(llclose(TRUE)) {
         printf("Failed to close connection\n"); 
         return;
     }
 
-    printf("Time elapsed: %f\n", (double)(end - start) / CLOCKS_PER_SEC);
-    double bitRate = (double) globalFileSize * 8 / (double)(end - start) * CLOCKS_PER_SEC;
+    printf("Time elapsed: %f\n", seconds);
+    double bitRate = seconds > 0 ? globalFileSize * 8 / seconds : 0;
     printf("Bitrate: %f\n", bitRate);
 
+    const char* statsFile = connectionParameters.role == LlTx ? STATS_FILE_TX : STATS_FILE_RX;
+    if(statsFile != NULL && statsWriteReport(statsFile, role, globalFileSize, seconds) == 0) {
+        printf("Statistics written to %s\n", statsFile);
+    }
+
     return;
 
 }
@@ -0,0 +1,521 @@
+// Link bonding implementation
+// Sender: packets are numbered as they are encoded and queued, one thread per link takes them from the queue as
+// its window lets it and no other link would get them off the line sooner, so faster links take more. A link that fails hands its unacknowledged packets back to the
+// queue and is announced to the receiver, in sequence, with a DOWN packet.
+// Receiver: one thread per link reads packets and files them by sequence number in a reorder window, bondRead
+// hands them over in order.
+
+#include "bond.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#define BOND_DATA 0x00
+#define BOND_DOWN 0x01 // the sender gave up on a link, byte BOND_HEADER is its index
+#define BOND_QUEUE 64 // packets waiting for a link
+#define BOND_HISTORY 16 // last packets sent on a link, a window holds at most 15
+#define BOND_QUEUE_CAPACITY (BOND_QUEUE + MAX_BOND_LINKS * (BOND_HISTORY + 1)) // queued, handed back and DOWN
+#define BOND_REORDER 512 // packets ahead of the next one in sequence the receiver keeps
+
+extern int DEBUG;
+
+typedef struct
+{
+    int present;
+    int size;
+    unsigned char packet[MAX_PAYLOAD_SIZE + MAX_FCS_SIZE];
+} BondSlot;
+
+typedef struct
+{
+    Bond* bond;
+    int index;
+    char port[50];
+    LinkConnection* conn;
+    pthread_t thread;
+    int alive;
+    int idle;    // sender: nothing to send and nothing unacknowledged
+    int stopped; // receiver: the reader is to quit
+    int paused;  // receiver: the reader leaves the link to a reply
+    int parked;
+    int outstanding; // sender: frames not acknowledged when the link last looked
+    EncodedFrame current;
+    EncodedFrame history[BOND_HISTORY];
+    long nSent;
+    long payloadBytes;
+    long long lineFreeAt; // sender: when what it wrote will have left the line (us), as the link layer models it
+    double byteTime;      // sender: us per byte on the line, 0 when unknown
+} BondLink;
+
+struct Bond
+{
+    LinkLayerRole role;
+    int nLinks;
+    BondLink links[MAX_BOND_LINKS];
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // anything below changed
+    uint32_t nextSeq;       // sender: next number to give out, receiver: next one to hand over
+    uint32_t replySeq;      // receiver: next number for its replies
+    int closing;
+    int failed;             // every link failed
+    EncodedFrame* queue;    // sender
+    int queueHead;
+    int queueCount;
+    BondSlot* reorder;      // receiver, slot seq % BOND_REORDER
+    long nReceived;         // receiver: packets the readers took from any link
+    long long idleLimit;    // receiver: us without a packet after which bondRead gives up
+    long long openedAt;
+};
+
+long long bondMicros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Time micros from now on the clock of pthread_cond_timedwait.
+struct timespec bondDeadline(long long micros) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    long long nanos = deadline.tv_nsec + micros % 1000000 * 1000;
+    deadline.tv_sec += micros / 1000000 + nanos / 1000000000;
+    deadline.tv_nsec = nanos % 1000000000;
+    return deadline;
+}
+
+void putSeq(unsigned char* bytes, uint32_t seq) {
+    bytes[0] = (seq >> 24) & 0xFF;
+    bytes[1] = (seq >> 16) & 0xFF;
+    bytes[2] = (seq >> 8) & 0xFF;
+    bytes[3] = seq & 0xFF;
+}
+
+uint32_t getSeq(const unsigned char* bytes) {
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+// Encodes one packet of the given kind, the bond must be locked.
+// Return "0" on success or "-1" on error.
+int encodeLocked(Bond* bond, int kind, const unsigned char *header, int headerSize, const unsigned char *data,
+                 int dataSize, EncodedFrame *frame) {
+    unsigned char bondHeader[MAX_PAYLOAD_SIZE];
+    if(BOND_HEADER + headerSize > MAX_PAYLOAD_SIZE) {
+        printf("Payload of %d bytes exceeds MAX_PAYLOAD_SIZE\n", BOND_HEADER + headerSize + dataSize);
+        return -1;
+    }
+    uint32_t* seq = bond->role == LlTx ? &bond->nextSeq : &bond->replySeq;
+    bondHeader[0] = kind;
+    putSeq(bondHeader + 1, *seq);
+    memcpy(bondHeader + BOND_HEADER, header, headerSize);
+    // every link negotiated the same FCS and FEC, any of them encodes for all
+    if(llencodeOn(bond->links[0].conn, bondHeader, BOND_HEADER + headerSize, data, dataSize, frame) != 0) return -1;
+    frame->bondSeq = *seq;
+    (*seq)++;
+    return 0;
+}
+
+int bondEncode(Bond* bond, const unsigned char *header, int headerSize, const unsigned char *data, int dataSize,
+               EncodedFrame *frame) {
+    pthread_mutex_lock(&bond->lock);
+    int result = encodeLocked(bond, BOND_DATA, header, headerSize, data, dataSize, frame);
+    pthread_mutex_unlock(&bond->lock);
+    return result;
+}
+
+// Gives up on a sending link: the packets it may not have delivered go back to the front of the queue,
+// oldest first, and the receiver is told. The bond must be locked.
+void failLink(BondLink* link, int unacknowledged) {
+    Bond* bond = link->bond;
+    link->alive = FALSE;
+    link->idle = TRUE;
+    printf("Link %d (%s) failed, its packets move to the other links\n", link->index, link->port);
+
+    if(unacknowledged > BOND_HISTORY) unacknowledged = BOND_HISTORY;
+    if(unacknowledged > link->nSent) unacknowledged = link->nSent;
+    for(int i = 0; i < unacknowledged; i++) {
+        bond->queueHead = (bond->queueHead + BOND_QUEUE_CAPACITY - 1) % BOND_QUEUE_CAPACITY;
+        bond->queue[bond->queueHead] = link->history[(link->nSent - 1 - i) % BOND_HISTORY];
+        bond->queueCount++;
+    }
+
+    int anyAlive = FALSE;
+    for(int i = 0; i < bond->nLinks; i++) anyAlive = anyAlive || bond->links[i].alive;
+    unsigned char index = link->index;
+    EncodedFrame* down = &bond->queue[(bond->queueHead + bond->queueCount) % BOND_QUEUE_CAPACITY];
+    if(!anyAlive) {
+        printf("Every link of the bond failed\n");
+        bond->failed = TRUE;
+    } else if(encodeLocked(bond, BOND_DOWN, &index, 1, NULL, 0, down) == 0) {
+        bond->queueCount++;
+    }
+    pthread_cond_broadcast(&bond->changed);
+}
+
+// Whether the packet at the front of the queue may go out: the receiver files at most BOND_REORDER packets from
+// the oldest one still unacknowledged on any link, which a stalled link may hold up until it is given up.
+// The bond must be locked.
+int queueHeadReady(Bond* bond) {
+    if(bond->queueCount == 0) return FALSE;
+    uint32_t seq = bond->queue[bond->queueHead].bondSeq;
+    for(int i = 0; i < bond->nLinks; i++) {
+        BondLink* link = &bond->links[i];
+        if(!link->alive || link->outstanding == 0) continue;
+        uint32_t oldest = link->history[(link->nSent - link->outstanding) % BOND_HISTORY].bondSeq;
+        if((int32_t)(seq - oldest) >= BOND_REORDER) return FALSE;
+    }
+    return TRUE;
+}
+
+// When size more bytes written on link would have left the line, from now (us). The bond must be locked.
+long long lineDone(BondLink* link, int size, long long now) {
+    return (link->lineFreeAt > now ? link->lineFreeAt : now) + (long long)(size * link->byteTime);
+}
+
+// Whether link gets the packet at the front of the queue off the line no later than any other link still up,
+// so a slow link only takes packets while the faster ones have a backlog. The bond must be locked.
+int soonestLink(Bond* bond, BondLink* link) {
+    if(link->byteTime <= 0 || link->nSent == 0) return TRUE; // its speed is only known once it has carried a packet
+    int size = bond->queue[bond->queueHead].size;
+    long long now = bondMicros();
+    long long done = lineDone(link, size, now);
+    for(int i = 0; i < bond->nLinks; i++) {
+        BondLink* other = &bond->links[i];
+        if(other == link || !other->alive || other->byteTime <= 0) continue;
+        if(lineDone(other, size, now) < done) return FALSE;
+    }
+    return TRUE;
+}
+
+// Keeps the line model of the link layer where other senders can read it. The bond must be locked.
+void updateLine(BondLink* link) {
+    link->lineFreeAt = lllineFreeAtOn(link->conn);
+    link->byteTime = llbyteTimeOn(link->conn);
+}
+
+// Sending link: takes packets from the queue while its window has room, and collects acknowledgements whenever
+// the queue runs dry, so nothing waits on a link with nothing else to send.
+void* bondSender(void* arg) {
+    BondLink* link = arg;
+    Bond* bond = link->bond;
+
+    pthread_mutex_lock(&bond->lock);
+    while(TRUE) {
+        if(queueHeadReady(bond) && soonestLink(bond, link)) {
+            link->current = bond->queue[bond->queueHead];
+            bond->queueHead = (bond->queueHead + 1) % BOND_QUEUE_CAPACITY;
+            bond->queueCount--;
+            link->idle = FALSE;
+            pthread_cond_broadcast(&bond->changed);
+            pthread_mutex_unlock(&bond->lock);
+
+            int written = llwriteEncodedOn(link->conn, &link->current);
+            int unacknowledged = lloutstandingOn(link->conn);
+
+            pthread_mutex_lock(&bond->lock);
+            link->history[link->nSent++ % BOND_HISTORY] = link->current;
+            if(written < 0) {
+                failLink(link, unacknowledged + 1);
+                break;
+            }
+            link->outstanding = unacknowledged;
+            link->payloadBytes += written - BOND_HEADER;
+            updateLine(link);
+            pthread_cond_broadcast(&bond->changed);
+        } else if(!link->idle) {
+            pthread_mutex_unlock(&bond->lock);
+            int flushed = llflushOn(link->conn);
+            int unacknowledged = lloutstandingOn(link->conn);
+            pthread_mutex_lock(&bond->lock);
+            if(flushed == -1) {
+                failLink(link, unacknowledged);
+                break;
+            }
+            link->outstanding = 0;
+            link->idle = TRUE;
+            updateLine(link);
+            pthread_cond_broadcast(&bond->changed);
+        } else if(bond->closing && bond->queueCount == 0) {
+            break;
+        } else {
+            pthread_cond_wait(&bond->changed, &bond->lock);
+        }
+    }
+    pthread_mutex_unlock(&bond->lock);
+    return NULL;
+}
+
+// Receiving link: files each packet at its place in the reorder window, waiting for room when it is far ahead.
+void* bondReader(void* arg) {
+    BondLink* link = arg;
+    Bond* bond = link->bond;
+    unsigned char packet[MAX_PAYLOAD_SIZE + MAX_FCS_SIZE];
+
+    pthread_mutex_lock(&bond->lock);
+    while(!link->stopped) {
+        if(link->paused) {
+            link->parked = TRUE;
+            pthread_cond_broadcast(&bond->changed);
+            pthread_cond_wait(&bond->changed, &bond->lock);
+            continue;
+        }
+        link->parked = FALSE;
+        pthread_mutex_unlock(&bond->lock);
+
+        int bytes = llreadOn(link->conn, packet);
+
+        pthread_mutex_lock(&bond->lock);
+        if(bytes < 0) {
+            printf("Link %d (%s) failed\n", link->index, link->port);
+            link->alive = FALSE;
+            break;
+        }
+        if(bytes < BOND_HEADER) continue; // interrupted, or not from a bond
+        bond->nReceived++;
+        uint32_t seq = getSeq(packet + 1);
+        while(!link->stopped && (int32_t)(seq - bond->nextSeq) >= BOND_REORDER) {
+            pthread_cond_wait(&bond->changed, &bond->lock);
+        }
+        // anything before nextSeq was handed over already, it came again on another link
+        BondSlot* slot = &bond->reorder[seq % BOND_REORDER];
+        if((int32_t)(seq - bond->nextSeq) >= 0 && !slot->present) {
+            memcpy(slot->packet, packet, bytes);
+            slot->size = bytes;
+            slot->present = TRUE;
+            link->nSent++;
+            link->payloadBytes += bytes - BOND_HEADER;
+            pthread_cond_broadcast(&bond->changed);
+        }
+    }
+    link->parked = TRUE;
+    pthread_cond_broadcast(&bond->changed);
+    pthread_mutex_unlock(&bond->lock);
+    return NULL;
+}
+
+// First link still up, which carries the replies of the receiver. The bond must be locked.
+// Return the link, or NULL if there is none.
+BondLink* replyLink(Bond* bond) {
+    for(int i = 0; i < bond->nLinks; i++) {
+        if(bond->links[i].alive) return &bond->links[i];
+    }
+    return NULL;
+}
+
+Bond* bondOpen(LinkLayer connectionParameters) {
+    Bond* bond = calloc(1, sizeof(Bond));
+    if(bond == NULL) {
+        printf("Failed to allocate bond\n");
+        return NULL;
+    }
+    bond->role = connectionParameters.role;
+    bond->idleLimit = (long long)connectionParameters.timeout * (connectionParameters.nRetransmissions + 1) * 1000000;
+    bond->queue = bond->role == LlTx ? malloc(BOND_QUEUE_CAPACITY * sizeof(EncodedFrame)) : NULL;
+    bond->reorder = bond->role == LlRx ? calloc(BOND_REORDER, sizeof(BondSlot)) : NULL;
+    if(bond->queue == NULL && bond->reorder == NULL) {
+        printf("Failed to allocate bond\n");
+        free(bond);
+        return NULL;
+    }
+    pthread_mutex_init(&bond->lock, NULL);
+    pthread_cond_init(&bond->changed, NULL);
+
+    char ports[sizeof(connectionParameters.serialPort)];
+    strcpy(ports, connectionParameters.serialPort);
+    char* save = NULL;
+    for(char* port = strtok_r(ports, ",", &save); port != NULL; port = strtok_r(NULL, ",", &save)) {
+        if(bond->nLinks == MAX_BOND_LINKS || strlen(port) >= sizeof(bond->links[0].port)) {
+            printf("Too many or too long ports to bond\n");
+            bondClose(bond, FALSE);
+            return NULL;
+        }
+        BondLink* link = &bond->links[bond->nLinks];
+        strcpy(link->port, port);
+        strcpy(connectionParameters.serialPort, port);
+        link->conn = llconnect(connectionParameters);
+        if(link->conn == NULL) {
+            printf("Failed to open link %d (%s)\n", bond->nLinks, port);
+            bondClose(bond, FALSE);
+            return NULL;
+        }
+        link->bond = bond;
+        link->index = bond->nLinks;
+        link->alive = TRUE;
+        link->idle = TRUE;
+        updateLine(link);
+        bond->nLinks++;
+        if(DEBUG) printf("Link %d open on %s\n", link->index, port);
+    }
+
+    for(int i = 0; i < bond->nLinks; i++) {
+        pthread_create(&bond->links[i].thread, NULL, bond->role == LlTx ? bondSender : bondReader, &bond->links[i]);
+    }
+    bond->openedAt = bondMicros();
+    return bond;
+}
+
+int bondWriteEncoded(Bond* bond, const EncodedFrame *frame) {
+    pthread_mutex_lock(&bond->lock);
+
+    if(bond->role == LlRx) {
+        // a reply: the reader steps aside while the link is written and flushed
+        BondLink* link = replyLink(bond);
+        if(link == NULL) {
+            pthread_mutex_unlock(&bond->lock);
+            return -1;
+        }
+        link->paused = TRUE;
+        llinterrupt(link->conn);
+        while(!link->parked) pthread_cond_wait(&bond->changed, &bond->lock);
+        pthread_mutex_unlock(&bond->lock);
+
+        int written = llwriteEncodedOn(link->conn, frame);
+        if(written >= 0 && llflushOn(link->conn) == -1) written = -1;
+
+        pthread_mutex_lock(&bond->lock);
+        link->paused = FALSE;
+        pthread_cond_broadcast(&bond->changed);
+        pthread_mutex_unlock(&bond->lock);
+        return written;
+    }
+
+    while(!bond->failed && bond->queueCount >= BOND_QUEUE) pthread_cond_wait(&bond->changed, &bond->lock);
+    if(bond->failed) {
+        pthread_mutex_unlock(&bond->lock);
+        return -1;
+    }
+    bond->queue[(bond->queueHead + bond->queueCount) % BOND_QUEUE_CAPACITY] = *frame;
+    bond->queueCount++;
+    pthread_cond_broadcast(&bond->changed);
+    pthread_mutex_unlock(&bond->lock);
+    return frame->payloadSize;
+}
+
+int bondWritePacket(Bond* bond, const unsigned char *header, int headerSize, const unsigned char *data, int dataSize) {
+    EncodedFrame frame;
+    if(bondEncode(bond, header, headerSize, data, dataSize, &frame) != 0 || bondWriteEncoded(bond, &frame) < 0) {
+        return -1;
+    }
+    return headerSize + dataSize;
+}
+
+int bondFlush(Bond* bond) {
+    if(bond->role == LlRx) return 0; // replies are flushed as they are written
+
+    pthread_mutex_lock(&bond->lock);
+    while(!bond->failed) {
+        int idle = bond->queueCount == 0;
+        for(int i = 0; i < bond->nLinks; i++) idle = idle && bond->links[i].idle;
+        if(idle) break;
+        pthread_cond_wait(&bond->changed, &bond->lock);
+    }
+    int result = bond->failed ? -1 : 0;
+    pthread_mutex_unlock(&bond->lock);
+    return result;
+}
+
+int bondRead(Bond* bond, unsigned char *packet) {
+    if(bond->role == LlTx) {
+        // a reply, the senders are all idle once everything is acknowledged
+        if(bondFlush(bond) == -1) return -1;
+        pthread_mutex_lock(&bond->lock);
+        BondLink* link = replyLink(bond);
+        pthread_mutex_unlock(&bond->lock);
+        int bytes = llreadOn(link->conn, packet);
+        if(bytes < BOND_HEADER) return -1;
+        memmove(packet, packet + BOND_HEADER, bytes - BOND_HEADER);
+        return bytes - BOND_HEADER;
+    }
+
+    pthread_mutex_lock(&bond->lock);
+    // like llread, gives up once the transmitter has been silent on every link for longer than it keeps trying
+    long seen = bond->nReceived;
+    struct timespec deadline = bondDeadline(bond->idleLimit);
+    while(TRUE) {
+        BondSlot* slot = &bond->reorder[bond->nextSeq % BOND_REORDER];
+        int anyAlive = FALSE;
+        for(int i = 0; i < bond->nLinks; i++) anyAlive = anyAlive || bond->links[i].alive;
+        if(!slot->present) {
+            if(!anyAlive) break;
+            if(pthread_cond_timedwait(&bond->changed, &bond->lock, &deadline) == ETIMEDOUT) {
+                if(bond->nReceived == seen) {
+                    pthread_mutex_unlock(&bond->lock);
+                    printf("Nothing received for %lld s, the transmitter is gone\n", bond->idleLimit / 1000000);
+                    return -1;
+                }
+                seen = bond->nReceived;
+                deadline = bondDeadline(bond->idleLimit);
+            }
+            continue;
+        }
+        slot->present = FALSE;
+        bond->nextSeq++;
+        pthread_cond_broadcast(&bond->changed);
+
+        if(slot->packet[0] == BOND_DOWN && slot->size > BOND_HEADER && slot->packet[BOND_HEADER] < bond->nLinks) {
+            BondLink* link = &bond->links[slot->packet[BOND_HEADER]];
+            printf("Link %d (%s) failed on the other end\n", link->index, link->port);
+            link->alive = FALSE;
+            link->stopped = TRUE;
+            llinterrupt(link->conn);
+            continue;
+        }
+        int bytes = slot->size - BOND_HEADER;
+        memcpy(packet, slot->packet + BOND_HEADER, bytes);
+        pthread_mutex_unlock(&bond->lock);
+        return bytes;
+    }
+    pthread_mutex_unlock(&bond->lock);
+    printf("Every link of the bond failed\n");
+    return -1;
+}
+
+double bondFrameErrorRate(Bond* bond) {
+    double sum = 0;
+    int n = 0;
+    for(int i = 0; i < bond->nLinks; i++) {
+        if(bond->links[i].alive) {
+            sum += llframeErrorRateOn(bond->links[i].conn);
+            n++;
+        }
+    }
+    return n > 0 ? sum / n : 1;
+}
+
+int bondClose(Bond* bond, int showStatistics) {
+    // senders finish the queue and flush before they quit, readers quit at once
+    pthread_mutex_lock(&bond->lock);
+    bond->closing = TRUE;
+    for(int i = 0; i < bond->nLinks; i++) {
+        bond->links[i].stopped = TRUE;
+        if(bond->role == LlRx) llinterrupt(bond->links[i].conn);
+    }
+    pthread_cond_broadcast(&bond->changed);
+    pthread_mutex_unlock(&bond->lock);
+
+    if(bond->openedAt != 0) {
+        for(int i = 0; i < bond->nLinks; i++) pthread_join(bond->links[i].thread, NULL);
+    }
+    // the senders are done once their last frames are acknowledged
+    double seconds = (bondMicros() - bond->openedAt) / 1e6;
+    int result = 0;
+    for(int i = 0; i < bond->nLinks; i++) {
+        BondLink* link = &bond->links[i];
+        if(showStatistics) {
+            printf("Link %d (%s)%s: %ld packets, %.0f bytes/s\n", i, link->port, link->alive ? "" : ", failed",
+                   link->nSent, seconds > 0 ? link->payloadBytes / seconds : 0);
+        }
+        // a failed link cannot take part in DISC, nor can any while the bond is still being opened
+        if(!link->alive || bond->openedAt == 0) {
+            llabandon(link->conn);
+        } else if(lldisconnect(link->conn, showStatistics) != 0) {
+            result = -1;
+        }
+    }
+
+    pthread_cond_destroy(&bond->changed);
+    pthread_mutex_destroy(&bond->lock);
+    free(bond->queue);
+    free(bond->reorder);
+    free(bond);
+    return result;
+}
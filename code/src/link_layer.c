@@ -1,6 +1,21 @@
 // Link layer protocol implementation
 
 #include "link_layer.h"
+#include "bond.h"
+#include "reed_solomon.h"
+#include "stats.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
@@ -22,25 +37,31 @@
 #define RR1 0x85
 #define REJ0 0x01
 #define REJ1 0x81
+#define CI_N 0x10   // windowed I-frame, N(s) in the low nibble
+#define RR_N 0x20   // windowed RR, N(r) in the low nibble
+#define REJ_N 0x30  // windowed REJ, N(r) in the low nibble
+#define SREJ_N 0x50 // windowed SREJ, N(r) in the low nibble
+#define PARITY_N 0x60 // erasure parity frame, row in the low nibble
+#define SEQ_MASK 0x0F
+#define SEQ_MODULO 16
+
+#define RX_RING_SIZE 4096 // power of two
+
+#define PARITY_HEADER 2 // group number and frames in the group, then length and payload of each frame combined
+#define MAX_PARITY_ROWS 15
+#define MAX_PARITY_BLOCK (2 + MAX_PAYLOAD_SIZE)
+#define MAX_BODY_SIZE (PARITY_HEADER + MAX_PARITY_BLOCK + MAX_FCS_SIZE + MAX_FEC_SIZE) // parity frames are the longest
+
+#define FER_SMOOTHING (1.0 / 16) // weight of each new frame outcome in the error rate estimate
+
+#define MIN_RTO_MS 20
+#define RTO_GRANULARITY_MS 1
+#define LINE_BITS_PER_BYTE 12 // start bit, 8 data bits, parity and 2 stop bits, the longest character framing
 
 
 // GLOBALS
-int alarmEnabled = FALSE;
-int alarmCount = 0;
-int fd = 0;
-struct termios oldtio; // old settings to restore
-int frameNumber = 0;
 unsigned char escFlag[] = {ESC, 0x5E};
 unsigned char escEsc[] = {ESC, 0x5d}; 
-int timout = 0;
-int nRetransmissions = 0; 
-LinkLayerRole role;
-
-
-long bytesSent = 0;
-long bytesReceived = 0;
-int errorsSent = 0;
-int errorsReceived = 0;
 
 
 int DEBUG = FALSE;
@@ -50,11 +71,432 @@ int SIM_ERROR = FALSE;
 int ERROR_RATE = 10; // % error rate (0-100)
 
 
-// Alarm function handler
-void alarmHandler(int signal) {
-    alarmEnabled = FALSE;
-    alarmCount++;
-    if(DEBUG) printf("Alarm triggered, #%d\n", alarmCount);
+// Strongest frame check sequence to use, the weaker of both ends' choice is negotiated in llopen
+FcsMode FCS_MODE = FCS_CRC16;
+
+// Reed-Solomon forward error correction on I-frames: byte errors corrected per codeword, 0 for none.
+// The weaker of both ends' choice is negotiated in llopen, together with the FCS.
+int FEC_STRENGTH = 0;
+
+// Slice-by-8 CRC tables, built on the first llopen
+uint32_t crc16Table[8][256];
+uint32_t crc32Table[8][256];
+pthread_once_t crcTablesOnce = PTHREAD_ONCE_INIT;
+
+
+// ARQ settings, must match on both ends
+ArqMode ARQ_MODE = ARQ_GO_BACK_N;
+int WINDOW_SIZE = 7; // 1 on stop-and-wait, up to 15 on go-back-n, up to 8 on selective repeat
+
+
+// Erasure coding: after every ERASURE_DATA I-frames the sender adds ERASURE_PARITY parity frames, from which the
+// receiver rebuilds that many lost frames of the group without a retransmission. 0 for none, must match on both ends.
+int ERASURE_DATA = 0; // 2 up to the window size
+int ERASURE_PARITY = 1; // 1 up to MAX_PARITY_ROWS
+
+// Everything one serial link needs, the settings above are shared by all of them.
+// Each connection is driven by one thread at a time, different connections may run on different threads.
+struct LinkConnection
+{
+    int timerFd;
+    int timerArmed;
+    int timerExpired;
+    int wakeFd; // signalled by llinterrupt
+    int interrupted;
+    char port[sizeof(((LinkLayer*)0)->serialPort)];
+    int fd;
+    int hungUp; // the line is gone, waits end on the timer or llinterrupt only
+    const unsigned char* input; // read instead of fd on a connection from llconnectMemory
+    long inputSize;
+    long inputUsed;
+    struct termios oldtio; // old settings to restore
+    int termiosSaved;
+    int timout; // seconds, initial and maximum retransmission timeout
+    int nRetransmissions;
+    double byteTime; // us to put one byte on the line, from the configured baud rate down to what was seen, 0 when unknown
+    long long lineFreeAt; // when the bytes written so far will have left the line (us)
+    int lineTimed; // byteTime was seen on the line, rather than taken from the configured baud rate
+    long long idleLimit; // us without a byte from the peer after which llreadOn gives up, 0 to wait for ever
+    long idleFrom; // bytesReceived when the idle timer was armed, -1 while it is not
+
+    // Retransmission timeout estimation (RFC 6298), in milliseconds
+    double srtt;
+    double rttvar;
+    int rttSamples;
+    int rto;
+    LinkLayerRole role;
+
+    long bytesSent;
+    long bytesReceived;
+    int errorsSent;
+    int errorsReceived;
+    LinkStats stats;
+
+    // negotiated in llopen
+    FcsMode fcsMode;
+    int fecStrength;
+    RsCode fecCode;
+    int rxBodyLimit; // longest destuffed I-frame body accepted
+    unsigned char rxBody[MAX_BODY_SIZE]; // I-frame or parity frame body awaiting correction
+    int fecCorrected;
+
+    // Erasure coding, frame n belongs to group n / ERASURE_DATA
+    long txCount; // new I-frames sent
+    unsigned char txParity[MAX_PARITY_ROWS][MAX_PARITY_BLOCK];
+    int txParityLength;
+    long rxCount; // I-frames handed to the application, rxExpected is frame rxCount
+    long rxParityGroup; // group whose parity frames are in rxParity
+    long rxGroupSettled; // group already rebuilt or given up on
+    long rxHighest; // furthest frame seen
+    unsigned char rxParity[MAX_PARITY_ROWS][MAX_PARITY_BLOCK];
+    int rxParityPresent[MAX_PARITY_ROWS];
+    unsigned char rxSyndromes[MAX_PARITY_ROWS][MAX_PARITY_BLOCK];
+    unsigned char rxRebuilt[MAX_PARITY_ROWS][MAX_PARITY_BLOCK];
+    int framesRebuilt;
+
+    // Sender window: frames [txBase, txNext) are sent and waiting for acknowledgement
+    unsigned char txFrames[SEQ_MODULO][MAX_FRAME_SIZE];
+    int txFrameSizes[SEQ_MODULO];
+    int txBase;
+    int txNext;
+    int txRetries;
+    long long txSentAt[SEQ_MODULO]; // last transmission time (us)
+    long long txLineDoneAt[SEQ_MODULO]; // when the last transmission will have left the line (us)
+    int txOutQueued; // bytes in the port's output queue at the last timeout
+    long long txFirstSentAt[SEQ_MODULO];
+    int txPayloadSizes[SEQ_MODULO];
+    int txRetransmitted[SEQ_MODULO];
+    double frameErrorRate; // smoothed share of I-frames that were rejected or timed out
+
+    // Receiver window: rxExpected is the next sequence number to hand to the application
+    unsigned char rxFrames[SEQ_MODULO][MAX_PAYLOAD_SIZE];
+    int rxFrameSizes[SEQ_MODULO];
+    int rxBuffered[SEQ_MODULO];
+    int rxSrejSent[SEQ_MODULO]; // gap already asked for, until its frame arrives or the window moves past it
+    int rxExpected;
+    int rejSent;
+    int discReceived; // the other end closed the link while frames were expected
+
+    // Receive ring, filled with bulk reads and consumed one byte at a time by the state machines
+    unsigned char rxRing[RX_RING_SIZE];
+    unsigned int rxRingHead; // next byte to consume
+    unsigned int rxRingTail; // next free slot
+};
+
+// Connection behind llopen, llwrite, llread and llclose, or the bond when several ports were given
+LinkConnection* defaultConnection = NULL;
+Bond* defaultBond = NULL;
+
+
+long long nowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int seqModulo() {
+    return ARQ_MODE == ARQ_STOP_AND_WAIT ? 2 : SEQ_MODULO;
+}
+
+int windowSize() {
+    return ARQ_MODE == ARQ_STOP_AND_WAIT ? 1 : WINDOW_SIZE;
+}
+
+// Number of steps from sequence number a forward to b.
+int seqDistance(int a, int b) {
+    return (b - a + seqModulo()) % seqModulo();
+}
+
+int clampRto(LinkConnection* conn, double value) {
+    if(value < MIN_RTO_MS) return MIN_RTO_MS;
+    if(value > conn->timout * 1000) return conn->timout * 1000;
+    return (int)value;
+}
+
+// Feeds one round trip measurement into the smoothed estimator and recomputes the timeout.
+void updateRto(LinkConnection* conn, double sampleMs) {
+    if(conn->rttSamples++ == 0) {
+        conn->srtt = sampleMs;
+        conn->rttvar = sampleMs / 2;
+    } else {
+        double delta = conn->srtt > sampleMs ? conn->srtt - sampleMs : sampleMs - conn->srtt;
+        conn->rttvar = 0.75 * conn->rttvar + 0.25 * delta;
+        conn->srtt = 0.875 * conn->srtt + 0.125 * sampleMs;
+    }
+    conn->rto = clampRto(conn, conn->srtt + (4 * conn->rttvar > RTO_GRANULARITY_MS ? 4 * conn->rttvar : RTO_GRANULARITY_MS));
+}
+
+// Doubles the timeout after an expiry, up to timout seconds.
+void backoffRto(LinkConnection* conn) {
+    conn->rto = clampRto(conn, conn->rto * 2.0);
+}
+
+// Bits per second of a termios speed constant, or of a plain bits per second value.
+// Return "0" when unknown.
+int lineBitRate(int baudRate) {
+    switch(baudRate) {
+        case B0: return 0;
+        case B50: return 50;
+        case B75: return 75;
+        case B110: return 110;
+        case B134: return 134;
+        case B150: return 150;
+        case B200: return 200;
+        case B300: return 300;
+        case B600: return 600;
+        case B1200: return 1200;
+        case B1800: return 1800;
+        case B2400: return 2400;
+        case B4800: return 4800;
+        case B9600: return 9600;
+        case B19200: return 19200;
+        case B38400: return 38400;
+        case B57600: return 57600;
+        case B115200: return 115200;
+        case B230400: return 230400;
+        case B460800: return 460800;
+        case B500000: return 500000;
+        case B576000: return 576000;
+        case B921600: return 921600;
+        case B1000000: return 1000000;
+        default: return baudRate >= 50 ? baudRate : 0;
+    }
+}
+
+// Accounts for bytes just written in the line model.
+// Return when they will have left the line (us).
+long long lineWritten(LinkConnection* conn, int bytes) {
+    long long now = nowMicros();
+    if(conn->lineFreeAt < now) conn->lineFreeAt = now;
+    conn->lineFreeAt += (long long)(bytes * conn->byteTime);
+    return conn->lineFreeAt;
+}
+
+// Arms the timer to expire micros from now, running or not.
+void armTimer(LinkConnection* conn, long long micros) {
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = micros / 1000000;
+    spec.it_value.tv_nsec = (long)(micros % 1000000) * 1000;
+    timerfd_settime(conn->timerFd, 0, &spec, NULL);
+    conn->timerArmed = TRUE;
+    conn->timerExpired = FALSE;
+}
+
+// Arms the retransmission timer for rto milliseconds after the oldest outstanding frame, or with none outstanding
+// the last byte written, has left the line, unless it is already running.
+void startTimer(LinkConnection* conn) {
+    if(conn->timerArmed) return;
+    long long timeout = conn->rto * 1000LL;
+    if(conn->txBase != conn->txNext) {
+        long long onLine = conn->txLineDoneAt[conn->txBase] - nowMicros();
+        if(!conn->lineTimed) {
+            // no longer than the frames in flight take, the line model runs ahead when the line is faster than configured
+            long inFlight = 0;
+            for(int seq = conn->txBase; seq != conn->txNext; seq = (seq + 1) % seqModulo()) inFlight += conn->txFrameSizes[seq];
+            if(onLine > inFlight * conn->byteTime) onLine = inFlight * conn->byteTime;
+        }
+        if(onLine > 0) timeout += onLine;
+    } else if(conn->lineFreeAt > nowMicros()) {
+        // a supervision frame waits behind what is still on the line
+        timeout += conn->lineFreeAt - nowMicros();
+    }
+    armTimer(conn, timeout);
+}
+
+void stopTimer(LinkConnection* conn) {
+    struct itimerspec spec = {0};
+    timerfd_settime(conn->timerFd, 0, &spec, NULL);
+    conn->timerArmed = FALSE;
+    conn->timerExpired = FALSE;
+}
+
+// Blocks in poll() until the serial port is readable or the running timer expires.
+// Return "1" when there is input, "0" on timeout or error.
+int waitInput(LinkConnection* conn) {
+    struct pollfd fds[3] = {{conn->hungUp ? -1 : conn->fd, POLLIN, 0}, {conn->wakeFd, POLLIN, 0}, {conn->timerFd, POLLIN, 0}};
+    while(TRUE) {
+        if(poll(fds, conn->timerArmed ? 3 : 2, -1) < 0) {
+            if(errno == EINTR) continue;
+            perror("poll");
+            return FALSE;
+        }
+        if(fds[0].revents & POLLIN) return TRUE;
+        if(fds[0].revents) {
+            conn->hungUp = TRUE;
+            fds[0].fd = -1;
+        }
+        if(fds[1].revents & POLLIN) {
+            uint64_t count;
+            read(conn->wakeFd, &count, sizeof(count));
+            conn->interrupted = TRUE;
+            return FALSE;
+        }
+        if(conn->timerArmed && (fds[2].revents & POLLIN)) {
+            uint64_t expirations;
+            read(conn->timerFd, &expirations, sizeof(expirations));
+            conn->timerArmed = FALSE;
+            conn->timerExpired = TRUE;
+            if(DEBUG) printf("Timer expired\n");
+            return FALSE;
+        }
+    }
+}
+
+// Stop-and-wait keeps the original one-bit control fields, windowed modes carry the sequence number in the low nibble.
+unsigned char iControl(int ns) {
+    if(ARQ_MODE == ARQ_STOP_AND_WAIT) return ns == 0 ? CI_0 : CI_1;
+    return CI_N | ns;
+}
+
+unsigned char rrControl(int nr) {
+    if(ARQ_MODE == ARQ_STOP_AND_WAIT) return nr == 0 ? RR0 : RR1;
+    return RR_N | nr;
+}
+
+unsigned char rejControl(int nr) {
+    if(ARQ_MODE == ARQ_STOP_AND_WAIT) return nr == 0 ? REJ0 : REJ1;
+    return REJ_N | nr;
+}
+
+int isIControl(unsigned char c) {
+    if(ARQ_MODE == ARQ_STOP_AND_WAIT) return c == CI_0 || c == CI_1;
+    return (c & ~SEQ_MASK) == CI_N;
+}
+
+// Returns RR_N, REJ_N or SREJ_N for a supervision control field of the current mode, "0" otherwise.
+int isParityControl(unsigned char c) {
+    return ERASURE_DATA > 0 && (c & ~SEQ_MASK) == PARITY_N;
+}
+
+unsigned char supervisionType(unsigned char c) {
+    if(ARQ_MODE == ARQ_STOP_AND_WAIT) {
+        if(c == RR0 || c == RR1) return RR_N;
+        if(c == REJ0 || c == REJ1) return REJ_N;
+        return 0;
+    }
+    unsigned char type = c & ~SEQ_MASK;
+    if(type == RR_N || type == REJ_N) return type;
+    if(type == SREJ_N && ARQ_MODE == ARQ_SELECTIVE_REPEAT) return type;
+    return 0;
+}
+
+// Sequence number carried by an I, RR, REJ or SREJ control field.
+int controlSeq(unsigned char c) {
+    if(ARQ_MODE == ARQ_STOP_AND_WAIT) return (c & (CI_1 | (RR1 ^ RR0))) ? 1 : 0;
+    return c & SEQ_MASK;
+}
+
+// Takes the next received byte from the ring, refilling it with a single read() when it runs empty.
+// Blocks until input arrives or the running timer expires.
+// Return "1" if a byte was taken, "0" if there is nothing to read.
+int readByte(LinkConnection* conn, unsigned char* byte) {
+    if(conn->rxRingHead == conn->rxRingTail) {
+        unsigned int offset = conn->rxRingTail & (RX_RING_SIZE - 1);
+        int bytes;
+        if(conn->input != NULL) {
+            // the end of an in-memory stream reads like llinterrupt
+            bytes = conn->inputSize - conn->inputUsed < RX_RING_SIZE - offset ? conn->inputSize - conn->inputUsed : RX_RING_SIZE - offset;
+            if(bytes == 0) {
+                conn->interrupted = TRUE;
+                return FALSE;
+            }
+            memcpy(&conn->rxRing[offset], conn->input + conn->inputUsed, bytes);
+            conn->inputUsed += bytes;
+        } else {
+            if(conn->timerExpired || waitInput(conn) == FALSE) return FALSE;
+            bytes = read(conn->fd, &conn->rxRing[offset], RX_RING_SIZE - offset);
+            if(bytes < 1) {
+                if(bytes == 0 || errno == EIO) conn->hungUp = TRUE; // end of file only comes once the line is gone
+                return FALSE;
+            }
+        }
+        conn->bytesReceived += bytes;
+        conn->rxRingTail += bytes;
+    }
+    *byte = conn->rxRing[conn->rxRingHead++ & (RX_RING_SIZE - 1)];
+    return TRUE;
+}
+
+// Builds the slice-by-8 tables of a reflected CRC with the given (reflected) polynomial.
+void buildCrcTable(uint32_t table[8][256], uint32_t polynomial) {
+    for(int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for(int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ polynomial : crc >> 1;
+        }
+        table[0][i] = crc;
+    }
+    for(int k = 1; k < 8; k++) {
+        for(int i = 0; i < 256; i++) {
+            table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+        }
+    }
+}
+
+void buildCrcTables() {
+    buildCrcTable(crc16Table, 0x8408);
+    buildCrcTable(crc32Table, 0xEDB88320);
+}
+
+// Runs a reflected CRC over data eight bytes per step, crc holds the register (before the final XOR).
+uint32_t crcUpdate(uint32_t table[8][256], uint32_t crc, const unsigned char* data, int size) {
+    while(size >= 8) {
+        uint32_t one = (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24) ^ crc;
+        uint32_t two = data[4] | data[5] << 8 | data[6] << 16 | (uint32_t)data[7] << 24;
+        crc = table[7][one & 0xFF] ^ table[6][(one >> 8) & 0xFF] ^ table[5][(one >> 16) & 0xFF] ^ table[4][one >> 24] ^
+              table[3][two & 0xFF] ^ table[2][(two >> 8) & 0xFF] ^ table[1][(two >> 16) & 0xFF] ^ table[0][two >> 24];
+        data += 8;
+        size -= 8;
+    }
+    while(size-- > 0) {
+        crc = table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+// CRC-16-CCITT as used by the HDLC FCS-16 (X.25).
+uint16_t crc16(const unsigned char* data, int size) {
+    return crcUpdate(crc16Table, 0xFFFF, data, size) ^ 0xFFFF;
+}
+
+// CRC-32 as used by the HDLC FCS-32 (IEEE 802.3).
+uint32_t crc32(const unsigned char* data, int size) {
+    return crcUpdate(crc32Table, 0xFFFFFFFF, data, size) ^ 0xFFFFFFFF;
+}
+
+int fcsLength(LinkConnection* conn) {
+    if(conn->fcsMode == FCS_CRC32) return 4;
+    if(conn->fcsMode == FCS_CRC16) return 2;
+    return 1;
+}
+
+// Frame check sequence of header followed by data, bcc2 is the XOR of both.
+uint32_t frameFcs(LinkConnection* conn, const unsigned char* header, int headerSize, const unsigned char* data, int dataSize, unsigned char bcc2) {
+    if(conn->fcsMode == FCS_CRC16) return crcUpdate(crc16Table, crcUpdate(crc16Table, 0xFFFF, header, headerSize), data, dataSize) ^ 0xFFFF;
+    if(conn->fcsMode == FCS_CRC32) return crcUpdate(crc32Table, crcUpdate(crc32Table, 0xFFFFFFFF, header, headerSize), data, dataSize) ^ 0xFFFFFFFF;
+    return bcc2;
+}
+
+// Appends the frame check sequence of header followed by data (least significant byte first), stuffed, to buffer.
+// bcc2 is the XOR of both, already computed while stuffing them.
+void writeFcs(LinkConnection* conn, const unsigned char* header, int headerSize, const unsigned char* data, int dataSize, unsigned char bcc2, unsigned char* buffer, int* idx) {
+    uint32_t fcs = frameFcs(conn, header, headerSize, data, dataSize, bcc2);
+    for(int i = 0; i < fcsLength(conn); i++) {
+        unsigned char byte = (fcs >> (8 * i)) & 0xFF;
+        writeByte(&byte, buffer, idx);
+    }
+}
+
+// Checks the frame check sequence that follows size bytes of data.
+// bcc2 is the XOR of data and the trailing FCS, accumulated while destuffing.
+// Return "1" if it matches, "0" otherwise.
+int checkFcs(LinkConnection* conn, const unsigned char* data, int size, unsigned char bcc2) {
+    if(conn->fcsMode == FCS_BCC) return bcc2 == 0;
+    uint32_t fcs = conn->fcsMode == FCS_CRC16 ? crc16(data, size) : crc32(data, size);
+    for(int i = 0; i < fcsLength(conn); i++) {
+        if(data[size + i] != ((fcs >> (8 * i)) & 0xFF)) return FALSE;
+    }
+    return TRUE;
 }
 
 int cHandler(Action act, unsigned char buf) {
@@ -66,28 +508,29 @@ int cHandler(Action act, unsigned char buf) {
             if(buf == C_UA) return 1;
             break;
         case WRITE:
-            if(buf == RR0 || buf == RR1 || buf == REJ0 || buf == REJ1) return 1;
+            if(supervisionType(buf) || isIControl(buf)) return 1;
             break;
         case READ:
-            if(buf == CI_0 || buf == CI_1) return 1;
+            if(isIControl(buf) || isParityControl(buf) || buf == C_DISC) return 1;
+            break;
         case CLOSETX:
-        case CLOSERX:
             if(buf == C_DISC) return 1;
             break;
+        case CLOSERX:
+            if(buf == C_DISC || isIControl(buf)) return 1;
+            break;
         default:
             break;
     }
     return 0;
 }
 
-int parseFrame(Action act, State* state, unsigned char* received, int* index) {
+int parseFrame(LinkConnection* conn, Action act, State* state, unsigned char* received, int* index) {
     int stop = FALSE;
     unsigned char buf;
-    int bytes = read(fd, &buf, 1);
-    if(bytes < 1) {
+    if(readByte(conn, &buf) == FALSE) {
         return stop;
     }
-    bytesReceived += bytes;
     switch(*state) {
         case START: 
             if(buf == FLAG_RCV) {
@@ -148,11 +591,52 @@ int parseFrame(Action act, State* state, unsigned char* received, int* index) {
                 received[*index] = buf;
                 *index+=1;
             }
+            else if((act == WRITE || act == CLOSERX) && isIControl(received[2])) {
+                // an I-frame from the peer, only its header matters while waiting for acknowledgements or DISC, its
+                // body is skipped so that nothing of it is left for the next read
+                *state = DD;
+            }
+            else if(act == RCV_SET || act == RCV_UA) {
+                // negotiation parameter
+                *state = D;
+                received[*index] = buf;
+                *index+=1;
+            }
             else {
                 *state = START;
                 *index = 0;
             } 
             break;
+        case D:
+            if(buf == received[4]) {
+                *state = BCC2;
+                received[*index] = buf;
+                *index+=1;
+            }
+            else if(buf == FLAG_RCV) {
+                *state = FLAG;
+                *index = 1;
+            }
+            else {
+                *state = START;
+                *index = 0;
+            }
+            break;
+        case BCC2:
+            if(buf == FLAG_RCV) {
+                stop = TRUE;
+                received[*index] = buf;
+                *index+=1;
+            }
+            else {
+                *state = START;
+                *index = 0;
+            }
+            break;
+        case DD:
+            // stuffing keeps FLAG out of the body, the first one closes the frame
+            if(buf == FLAG_RCV) stop = TRUE;
+            break;
         default:
             break; 
     }
@@ -164,27 +648,112 @@ int parseFrame(Action act, State* state, unsigned char* received, int* index) {
 ////////////////////////////////////////////////
 // LLOPEN
 ////////////////////////////////////////////////
-int llopen(LinkLayer connectionParameters) {
+// Sets up what depends on the negotiated FCS and FEC.
+void applyNegotiation(LinkConnection* conn) {
+    conn->rxBodyLimit = MAX_PAYLOAD_SIZE + fcsLength(conn);
+    if(conn->fecStrength > 0) {
+        rsBuildCode(&conn->fecCode, conn->fecStrength);
+        conn->rxBodyLimit += rsParitySize(&conn->fecCode, MAX_PAYLOAD_SIZE + fcsLength(conn));
+    }
+}
+
+// Checks the settings shared by all connections.
+// Return "0" on success or "-1" on error.
+int checkSettings() {
+    if(FEC_STRENGTH < 0 || FEC_STRENGTH > RS_MAX_STRENGTH) {
+        printf("Invalid FEC strength %d\n", FEC_STRENGTH);
+        return -1;
+    }
+
+    int maxWindow = ARQ_MODE == ARQ_SELECTIVE_REPEAT ? SEQ_MODULO / 2 : SEQ_MODULO - 1;
+    if(windowSize() < 1 || windowSize() > maxWindow) {
+        printf("Invalid window size %d\n", WINDOW_SIZE);
+        return -1;
+    }
+    // a whole group must fit in the window, the receiver holds back REJ until its parity arrives
+    if(ERASURE_DATA != 0 && (ERASURE_DATA < 2 || ERASURE_DATA > windowSize() ||
+                             ERASURE_PARITY < 1 || ERASURE_PARITY > MAX_PARITY_ROWS)) {
+        printf("Invalid erasure group of %d + %d frames\n", ERASURE_DATA, ERASURE_PARITY);
+        return -1;
+    }
+    return 0;
+}
+
+// Puts conn back to the state of a link that was just opened, before the FCS and FEC are negotiated.
+void resetConnection(LinkConnection* conn) {
+    conn->txBase = 0;
+    conn->txNext = 0;
+    conn->txRetries = 0;
+    conn->frameErrorRate = 0;
+    conn->rxExpected = 0;
+    conn->srtt = 0;
+    conn->rttvar = 0;
+    conn->rttSamples = 0;
+    conn->rto = conn->timout * 1000;
+    conn->lineFreeAt = 0;
+    conn->txOutQueued = 0;
+    conn->rejSent = FALSE;
+    conn->discReceived = FALSE;
+    conn->idleFrom = -1;
+    conn->fecCorrected = 0;
+    conn->txCount = 0;
+    conn->txParityLength = 0;
+    memset(conn->txParity, 0, sizeof(conn->txParity));
+    conn->rxCount = 0;
+    conn->rxParityGroup = -1;
+    conn->rxGroupSettled = -1;
+    conn->rxHighest = -1;
+    conn->framesRebuilt = 0;
+    memset(conn->rxBuffered, 0, sizeof(conn->rxBuffered));
+    memset(conn->rxSrejSent, 0, sizeof(conn->rxSrejSent));
+    conn->rxRingHead = 0;
+    conn->rxRingTail = 0;
+    statsInit(&conn->stats);
+}
+
+// Sets up conn on the port and exchanges SET and UA with the other end.
+// Return "0" on success or "-1" on error, whatever was opened is released by releaseConnection.
+int openConnection(LinkConnection* conn, LinkLayer connectionParameters) {
 
     const char *serialPortName = connectionParameters.serialPort;
-    role = connectionParameters.role;
-    nRetransmissions = connectionParameters.nRetransmissions;
-    timout = connectionParameters.timeout;
+    conn->role = connectionParameters.role;
+    conn->nRetransmissions = connectionParameters.nRetransmissions;
+    conn->timout = connectionParameters.timeout;
+    int bitRate = lineBitRate(connectionParameters.baudRate);
+    conn->byteTime = bitRate > 0 ? LINE_BITS_PER_BYTE * 1e6 / bitRate : 0;
+    conn->lineTimed = FALSE;
+
+    if(checkSettings() != 0) return -1;
+    resetConnection(conn);
+    strcpy(conn->port, serialPortName);
 
-    (void)signal(SIGALRM, alarmHandler);
+    conn->timerFd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (conn->timerFd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
+    conn->timerArmed = FALSE;
+    conn->timerExpired = FALSE;
 
-    fd = open(serialPortName, O_RDWR | O_NOCTTY);
-    if (fd < 0) {
+    conn->wakeFd = eventfd(0, 0);
+    if (conn->wakeFd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    conn->fd = open(serialPortName, O_RDWR | O_NOCTTY);
+    if (conn->fd < 0) {
         perror(serialPortName);
-        exit(-1);
+        return -1;
     }
 
     struct termios newtio;
 
-    if (tcgetattr(fd, &oldtio) == -1) {
+    if (tcgetattr(conn->fd, &conn->oldtio) == -1) {
         perror("tcgetattr");
-        exit(-1);
+        return -1;
     }
+    conn->termiosSaved = TRUE;
 
     memset(&newtio, 0, sizeof(newtio));
 
@@ -196,66 +765,84 @@ int llopen(LinkLayer connectionParameters) {
     newtio.c_cc[VTIME] = 0; 
     newtio.c_cc[VMIN] = 0; 
 
-    tcflush(fd, TCIOFLUSH);
+    tcflush(conn->fd, TCIOFLUSH);
 
-    if (tcsetattr(fd, TCSANOW, &newtio) == -1) {
+    if (tcsetattr(conn->fd, TCSANOW, &newtio) == -1) {
         perror("tcsetattr");
-        exit(-1);
+        return -1;
     }
 
 // -----------------------------------------------------
 
+    pthread_once(&crcTablesOnce, buildCrcTables);
+
+    // SET and UA carry the FCS and FEC choice as a one byte information field: F A C BCC1 P BCC2 F,
+    // with the FCS mode in the low nibble of P and the FEC strength in the high one.
+    // A plain 5 byte SET or UA means the peer only knows BCC.
     int stop = FALSE;
-    unsigned char received[5] = {0};
+    unsigned char received[7] = {0};
     int index = 0;
     State state = START;
-    unsigned char set_command[] = {FLAG_RCV, A_T, C_SET, A_T ^ C_SET, FLAG_RCV};
-    unsigned char ua_reply[] = {FLAG_RCV, A_T, C_UA, A_T ^ C_UA, FLAG_RCV};
+    unsigned char parameter = FCS_MODE | FEC_STRENGTH << 4;
+    unsigned char set_command[] = {FLAG_RCV, A_T, C_SET, A_T ^ C_SET, parameter, parameter, FLAG_RCV};
+    unsigned char ua_reply[] = {FLAG_RCV, A_T, C_UA, A_T ^ C_UA, 0, 0, FLAG_RCV};
     int nRepeated = 0;
     
-    switch (role) {
+    switch (conn->role) {
         case LlTx:
 
-            while(stop == FALSE && nRepeated < nRetransmissions) {
+            while(stop == FALSE && nRepeated < conn->nRetransmissions) {
 
-                int byte1 = write(fd, set_command, 5);
-                if(byte1 < 5) {
+                int byte1 = write(conn->fd, set_command, 7);
+                if(byte1 < 7) {
                     printf("Error writing SET\n");
                     return -1;
                 }
-                bytesSent += byte1;
+                conn->bytesSent += byte1;
                 if(DEBUG) printf("%d bytes written (SET)\n", byte1);
 
-                while (stop == FALSE && alarmCount < timout) {
-                    if (alarmEnabled == FALSE) {
-                        alarm(1); // Set alarm to be triggered in 1s
-                        alarmEnabled = TRUE;
-                    }
-
-                    stop = parseFrame(RCV_UA, &state, received, &index);
-
+                startTimer(conn);
+                while (stop == FALSE && conn->timerExpired == FALSE) {
+                    stop = parseFrame(conn, RCV_UA, &state, received, &index);
                 }
-                alarmCount = 0;
+                stopTimer(conn);
                 nRepeated++;
             }
             if(stop  == FALSE) {
                 printf("Error receiving UA\n");
                 return -1;
             }
+            conn->fcsMode = index == 7 && (received[4] & 0x0F) <= FCS_CRC32 ? received[4] & 0x0F : FCS_BCC;
+            conn->fecStrength = index == 7 ? received[4] >> 4 : 0;
+            if(conn->fecStrength > FEC_STRENGTH) conn->fecStrength = FEC_STRENGTH;
             break;
         
 
         case LlRx:
             
             while (stop == FALSE) {
-                stop = parseFrame(RCV_SET, &state, received, &index);
+                stop = parseFrame(conn, RCV_SET, &state, received, &index);
             }
 
-            if(write(fd, ua_reply, 5) < 5) {
+            int uaSize = 5;
+            conn->fcsMode = FCS_BCC;
+            conn->fecStrength = 0;
+            if(index == 7) {
+                conn->fcsMode = (received[4] & 0x0F) < FCS_MODE ? received[4] & 0x0F : FCS_MODE;
+                conn->fecStrength = (received[4] >> 4) < FEC_STRENGTH ? received[4] >> 4 : FEC_STRENGTH;
+                // a miscorrected frame would slip past the XOR check, FEC needs a CRC behind it
+                if(conn->fcsMode == FCS_BCC) conn->fecStrength = 0;
+                ua_reply[4] = conn->fcsMode | conn->fecStrength << 4;
+                ua_reply[5] = ua_reply[4];
+                uaSize = 7;
+            } else {
+                ua_reply[4] = FLAG_RCV;
+            }
+            if(write(conn->fd, ua_reply, uaSize) < uaSize) {
                 printf("Error writing UA\n");
                 return -1;
             }
-            bytesSent += 5;
+            conn->bytesSent += uaSize;
             break;
 
 
@@ -263,6 +850,10 @@ int llopen(LinkLayer connectionParameters) {
             break;
     }
 
+    applyNegotiation(conn);
+
+    if(DEBUG) printf("Frame check sequence: %s\n", conn->fcsMode == FCS_CRC32 ? "CRC-32" : conn->fcsMode == FCS_CRC16 ? "CRC-16" : "BCC");
+    if(DEBUG && conn->fecStrength > 0) printf("Reed-Solomon FEC: %d byte errors per codeword\n", conn->fecStrength);
     return 0;
 }
 
@@ -279,148 +870,721 @@ void writeByte(const unsigned char* byte, unsigned char* buffer, int* idx) {
     }
 }
 
-////////////////////////////////////////////////
-// LLWRITE
-////////////////////////////////////////////////
-int llwrite(const unsigned char *buf, int bufSize) {
-   
-    unsigned char control = frameNumber == 0 ? CI_0 : CI_1;
-    unsigned char header[] = { FLAG_RCV, A_T, control, A_T ^ control};
-    unsigned char buffer[bufSize * 2];
-    int idx = 4;
-    
-    memcpy(buffer, header, 4);
+// Copies the leading bytes of src that are neither FLAG nor ESC into dst and XORs them into bcc.
+// Scans a vector (AVX2 or SSE2) or a machine word at a time, stores never go past dst[size - 1].
+// Return number of bytes copied.
+int copyCleanRun(const unsigned char* src, int size, unsigned char* dst, unsigned char* bcc) {
+    int i = 0;
+    unsigned char x = *bcc;
 
-    unsigned char bcc2 = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+#if defined(__AVX2__)
+    #define VEC_WIDTH 32
+    __m256i flagVec = _mm256_set1_epi8(FLAG_RCV);
+    __m256i escVec = _mm256_set1_epi8(ESC);
+    __m256i acc = _mm256_setzero_si256();
+#else
+    #define VEC_WIDTH 16
+    __m128i flagVec = _mm_set1_epi8(FLAG_RCV);
+    __m128i escVec = _mm_set1_epi8(ESC);
+    __m128i acc = _mm_setzero_si128();
+#endif
+    while(i + VEC_WIDTH <= size) {
+#if defined(__AVX2__)
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(src + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, flagVec), _mm256_cmpeq_epi8(chunk, escVec)));
+        _mm256_storeu_si256((__m256i*)(dst + i), chunk);
+#else
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(src + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, flagVec), _mm_cmpeq_epi8(chunk, escVec)));
+        _mm_storeu_si128((__m128i*)(dst + i), chunk);
+#endif
+        if(mask != 0) {
+            // the clean prefix is already in place
+            int clean = __builtin_ctz(mask);
+            for(int k = 0; k < clean; k++) x ^= src[i + k];
+            i += clean;
+            break;
+        }
+#if defined(__AVX2__)
+        acc = _mm256_xor_si256(acc, chunk);
+#else
+        acc = _mm_xor_si128(acc, chunk);
+#endif
+        i += VEC_WIDTH;
+    }
+    unsigned char lanes[VEC_WIDTH];
+#if defined(__AVX2__)
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+#else
+    _mm_storeu_si128((__m128i*)lanes, acc);
+#endif
+    for(int k = 0; k < VEC_WIDTH; k++) x ^= lanes[k];
+    #undef VEC_WIDTH
+#else
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    uint64_t acc = 0;
+    while(i + 8 <= size) {
+        uint64_t word;
+        memcpy(&word, src + i, 8);
+        uint64_t flags = word ^ (ones * FLAG_RCV);
+        uint64_t escs = word ^ (ones * ESC);
+        // a zero byte in flags or escs is a byte that needs escaping, the scalar loop finds it
+        if((((flags - ones) & ~flags) | ((escs - ones) & ~escs)) & highs) break;
+        memcpy(dst + i, &word, 8);
+        acc ^= word;
+        i += 8;
+    }
+    for(int k = 0; k < 64; k += 8) x ^= (unsigned char)(acc >> k);
+#endif
 
-    int bytesWritten = 0;
-    while(bytesWritten < bufSize) {
-        bcc2 ^= buf[bytesWritten];
-        writeByte(&buf[bytesWritten++], buffer, &idx);
+    while(i < size && src[i] != FLAG_RCV && src[i] != ESC) {
+        dst[i] = src[i];
+        x ^= src[i++];
     }
+    *bcc = x;
+    return i;
+}
 
-    writeByte(&bcc2, buffer, &idx);
-    buffer[idx++] = FLAG_RCV;
-    int bytes;
-    int stop = FALSE;
-    int good_packet = FALSE;
-    int retransmission = TRUE;
+// Stuffs size bytes of src into dst (room for 2 * size bytes) and XORs them into bcc2 in the same pass.
+// Return number of bytes written to dst.
+int stuffBytes(const unsigned char* src, int size, unsigned char* dst, unsigned char* bcc2) {
+    int i = 0;
+    int out = 0;
+    while(i < size) {
+        int clean = copyCleanRun(src + i, size - i, dst + out, bcc2);
+        i += clean;
+        out += clean;
+        if(i < size) {
+            *bcc2 ^= src[i];
+            writeByte(&src[i++], dst, &out);
+        }
+    }
+    return out;
+}
+
+// Number of frames sent and not yet acknowledged.
+int outstanding(LinkConnection* conn) {
+    return seqDistance(conn->txBase, conn->txNext);
+}
+
+int transmitFrame(LinkConnection* conn, int seq) {
+    unsigned char* frame = conn->txFrames[seq];
+    int size = conn->txFrameSizes[seq];
+    int error = FALSE;
+    // simulate error
+    if(SIM_ERROR && rand() % 10000 < ERROR_RATE * 100) {
+        if(DEBUG) printf("Simulating error on frame number %d...\n", seq);
+        conn->errorsSent++;
+        error = TRUE;
+        frame[4] = frame[4] ^ 0xFF; // flips a byte
+    }
+    int bytes = write(conn->fd, frame, size);
+    long long now = nowMicros();
+    conn->txLineDoneAt[seq] = lineWritten(conn, size);
+    // Karn: a frame sent more than once gives no usable round trip sample
+    if(conn->txSentAt[seq] != 0) {
+        conn->txRetransmitted[seq] = TRUE;
+        conn->stats.retransmissions++;
+        histogramRecord(&conn->stats.retransmitDelay, now - conn->txSentAt[seq]);
+    }
+    conn->txSentAt[seq] = now;
+    if(error) {
+        frame[4] = frame[4] ^ 0xFF; // undo flip
+    }
+    if(bytes < size) {
+        printf("Error writing DATA\n");
+        return -1;
+    }
+    conn->bytesSent += bytes;
+    if(DEBUG) printf("I%d sent, %d bytes\n", seq, bytes);
+    return 0;
+}
+
+// Retransmits every outstanding frame from the window base on.
+int retransmitWindow(LinkConnection* conn) {
+    for(int seq = conn->txBase; seq != conn->txNext; seq = (seq + 1) % seqModulo()) {
+        if(transmitFrame(conn, seq) == -1) return -1;
+    }
+    return 0;
+}
+
+// Folds the outcome of one I-frame transmission into the frame error rate estimate.
+void recordFrameOutcome(LinkConnection* conn, int failed) {
+    double rate = conn->frameErrorRate + FER_SMOOTHING * ((failed ? 1.0 : 0.0) - conn->frameErrorRate);
+    __atomic_store(&conn->frameErrorRate, &rate, __ATOMIC_RELAXED);
+}
+
+// Read from the transmit pipeline's framer thread as well.
+double llframeErrorRateOn(LinkConnection* conn) {
+    double rate;
+    __atomic_load(&conn->frameErrorRate, &rate, __ATOMIC_RELAXED);
+    return rate;
+}
+
+// Slides the window base up to nr, if nr acknowledges outstanding frames.
+void acknowledge(LinkConnection* conn, int nr) {
+    int acked = seqDistance(conn->txBase, nr);
+    if(acked == 0 || acked > outstanding(conn)) return;
+    int last = (nr - 1 + seqModulo()) % seqModulo();
+    long long now = nowMicros();
+    long long early = conn->txLineDoneAt[last] - now;
+    // an acknowledgement of a frame sent again may answer an older copy, the new one can still be on the line
+    if(early > 0 && !conn->txRetransmitted[last]) {
+        // the line is faster than the configured baud rate, what is still outstanding leaves earlier too
+        conn->lineFreeAt -= early;
+        for(int seq = nr; seq != conn->txNext; seq = (seq + 1) % seqModulo()) conn->txLineDoneAt[seq] -= early;
+        conn->txLineDoneAt[last] = now;
+    }
+    // the sample starts once the frame has left the line, so the time to send it, long on a slow line and short
+    // for a control frame, does not count
+    if(!conn->txRetransmitted[last]) {
+        // the whole frame went over the line since it was written, the line is at least that fast
+        double byteTime = (double)(now - conn->txSentAt[last]) / conn->txFrameSizes[last];
+        if(byteTime < conn->byteTime) conn->byteTime = byteTime;
+        conn->lineTimed = TRUE;
+        long long sample = now - conn->txLineDoneAt[last];
+        updateRto(conn, sample / 1000.0);
+        histogramRecord(&conn->stats.rtt, sample);
+        if(DEBUG) printf("RTT sample %.3f ms, srtt %.3f ms, rto %d ms\n", sample / 1000.0, conn->srtt, conn->rto);
+    }
+    for(int i = 0; i < acked; i++) {
+        int seq = (conn->txBase + i) % seqModulo();
+        histogramRecord(&conn->stats.ackLatency, now - conn->txFirstSentAt[seq]);
+        goodputRecord(&conn->stats.goodput, now, conn->txPayloadSizes[seq]);
+        recordFrameOutcome(conn, FALSE);
+    }
+    conn->txBase = nr;
+    conn->txRetries = 0;
+    conn->txOutQueued = 0;
+    stopTimer(conn);
+}
+
+int sendSupervision(LinkConnection* conn, unsigned char control) {
+    unsigned char response[] = {FLAG_RCV, A_T, control, A_T ^ control, FLAG_RCV};
+    int bytes = write(conn->fd, response, 5);
+    if(bytes < 5) {
+        printf("Error writing response\n");
+        return -1;
+    }
+    lineWritten(conn, bytes);
+    conn->bytesSent += bytes;
+    if(supervisionType(control) == REJ_N) conn->stats.rejSent++;
+    if(supervisionType(control) == SREJ_N) conn->stats.srejSent++;
+    if(DEBUG) printf("%d bytes data response written (0x%02x)\n", bytes, control);
+    return 0;
+}
+
+// Waits for one supervision frame, or an I-frame from the peer, or a timeout and updates the send window.
+// Return "0" on success or "-1" on error.
+int waitAcknowledgement(LinkConnection* conn) {
     State state = START;
-    int nRepeated = 0;
-    int error;
-    
-    while(stop == FALSE && nRepeated <= nRetransmissions) {
-
-        if(retransmission == TRUE) {
-            // simulate error
-            if(SIM_ERROR) {
-                error = rand() % 10000;
-                if(error < ERROR_RATE * 100) {
-                    if(DEBUG) printf("Simulating error on frame number %d...\n", frameNumber);
-                    errorsSent++;
-                    buffer[4] = buffer[4] ^ 0xFF; // flips a byte
-                }
-            }
-            bytes = write(fd, buffer, idx);
-            nRepeated++;
-            if(SIM_ERROR && error < ERROR_RATE * 100) {
-                buffer[4] = buffer[4] ^ 0xFF; // undo flip           
+    unsigned char received[5] = {0};
+    int index = 0;
+    int good_packet = FALSE;
+
+    startTimer(conn);
+    while (good_packet == FALSE && conn->timerExpired == FALSE) {
+        good_packet = parseFrame(conn, WRITE, &state, received, &index);
+    }
+
+    if(good_packet == FALSE) {
+        stopTimer(conn);
+        // bytes still draining from the port's output queue are late because of the line, not lost
+        int queued = 0;
+        if(ioctl(conn->fd, TIOCOUTQ, &queued) == 0 && queued > 0 && (conn->txOutQueued == 0 || queued < conn->txOutQueued)) {
+            if(DEBUG) printf("Timeout with %d bytes still queued, waiting longer\n", queued);
+            conn->txOutQueued = queued;
+            return 0;
+        }
+        conn->txOutQueued = 0;
+        if(++conn->txRetries > conn->nRetransmissions) {
+            printf("Error sending frame due to max number of retransmissions\n");
+            return -1;
+        }
+        backoffRto(conn);
+        recordFrameOutcome(conn, TRUE);
+        conn->stats.timeouts++;
+        if(DEBUG) printf("Timeout, retransmitting from I%d\n", conn->txBase);
+        if(ARQ_MODE == ARQ_SELECTIVE_REPEAT) return transmitFrame(conn, conn->txBase);
+        return retransmitWindow(conn);
+    }
+
+    if(isIControl(received[2])) {
+        if(conn->role == LlRx) {
+            // the sender only goes on once it has read everything the receiver wrote
+            if(DEBUG) printf("I-frame received, replies acknowledged\n");
+            acknowledge(conn, conn->txNext);
+            return 0;
+        }
+        // a reply sent again because its acknowledgement was lost
+        if(DEBUG) printf("duplicate reply received, RR%d sent\n", conn->rxExpected);
+        return sendSupervision(conn, rrControl(conn->rxExpected));
+    }
+
+    int nr = controlSeq(received[2]);
+    switch(supervisionType(received[2])) {
+        case RR_N:
+            if(DEBUG) printf("RR%d received\n", nr);
+            acknowledge(conn, nr);
+            break;
+        case REJ_N:
+            if(DEBUG) printf("REJ%d received\n", nr);
+            conn->stats.rejReceived++;
+            acknowledge(conn, nr);
+            if(nr == conn->txBase && outstanding(conn) > 0) {
+                recordFrameOutcome(conn, TRUE);
+                stopTimer(conn);
+                return retransmitWindow(conn);
             }
-            if(bytes < idx) {
-                printf("Error writing DATA\n");
-                return -1;
+            break;
+        case SREJ_N:
+            if(DEBUG) printf("SREJ%d received\n", nr);
+            conn->stats.srejReceived++;
+            if(seqDistance(conn->txBase, nr) >= outstanding(conn)) break;
+            // the receiver asks again only for a copy it got damaged, one arriving before the last copy could have
+            // crossed the line was sent for an older copy
+            if(nowMicros() < conn->txSentAt[nr] + (long long)(conn->txFrameSizes[nr] * conn->byteTime)) {
+                if(DEBUG) printf("I%d already sent again\n", nr);
+                break;
             }
-            bytesSent += bytes;
+            recordFrameOutcome(conn, TRUE);
+            // the receiver is there, only timeouts count towards the retry limit
+            conn->txRetries = 0;
+            if(nr == conn->txBase) stopTimer(conn);
+            return transmitFrame(conn, nr);
+        default:
+            break;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////
+// LLWRITE
+////////////////////////////////////////////////
+// Stuffs header and data, their FCS (and Reed-Solomon check bytes covering all of them) and the closing flag
+// into buffer, after room for the 4 byte frame header.
+// Return the frame size.
+int encodeBody(LinkConnection* conn, const unsigned char *header, int headerSize, const unsigned char *data, int dataSize, unsigned char *buffer) {
+    int idx = 4;
+    unsigned char bcc2 = 0;
+
+    if(conn->fecStrength > 0) {
+        unsigned char body[MAX_BODY_SIZE];
+        int size = headerSize + dataSize;
+        memcpy(body, header, headerSize);
+        if(dataSize > 0) memcpy(body + headerSize, data, dataSize);
+        if(conn->fcsMode == FCS_BCC) {
+            for(int i = 0; i < size; i++) bcc2 ^= body[i];
         }
-        unsigned char received[5] = {0};
-        int index = 0;
-        good_packet = FALSE;
-        state = START;
-
-        while (good_packet == FALSE && alarmCount < timout) {
-            if (alarmEnabled == FALSE) {
-                alarm(1);
-                alarmEnabled = TRUE;
-            }
-            good_packet = parseFrame(WRITE, &state, received, &index);
+        uint32_t fcs = frameFcs(conn, body, size, NULL, 0, bcc2);
+        for(int i = 0; i < fcsLength(conn); i++) body[size++] = (fcs >> (8 * i)) & 0xFF;
+        rsEncode(&conn->fecCode, body, size, body + size);
+        size += rsParitySize(&conn->fecCode, size);
+        idx += stuffBytes(body, size, buffer + idx, &bcc2);
+    } else {
+        idx += stuffBytes(header, headerSize, buffer + idx, &bcc2);
+        idx += stuffBytes(data, dataSize, buffer + idx, &bcc2);
+        writeFcs(conn, header, headerSize, data, dataSize, bcc2, buffer, &idx);
+    }
+    buffer[idx++] = FLAG_RCV;
+    return idx;
+}
+
+// Recovers count bytes from the stuffed bytes at src.
+void destuffBytes(const unsigned char* src, unsigned char* dst, int count) {
+    for(int i = 0; i < count; i++) {
+        if(*src == ESC) {
+            src++;
+            dst[i] = *src++ ^ ESC_XOR;
+        } else {
+            dst[i] = *src++;
         }
-        int response_number = received[2] == RR0 ? 0 : 1;
-        switch(received[2]){
-            case RR0:
-            case RR1:
-                if(DEBUG) printf("RR%d received\n", response_number);
-                if(frameNumber != response_number) {
-                    frameNumber = response_number;
-                    stop = TRUE;
-                }
-                else {
-                    retransmission = FALSE;
-                    nRepeated = 0;
-                }
-                break;
-            case REJ0:
-                retransmission = frameNumber == 0 ? TRUE : FALSE;
-                if(DEBUG) printf("REJ0 received retransmission: %d\n", retransmission);
-                nRepeated = 0;
-                break;
-            case REJ1:
-                retransmission = frameNumber == 1 ? TRUE : FALSE;
-                if(DEBUG) printf("REJ1 received, retransmission: %d\n", retransmission);
-                nRepeated = 0;
-                break;
-            default:
-                break;
+    }
+}
+
+// Sends the parity frames of the current group, which has count I-frames:
+// F A PARITY_N|row BCC1 group count parity... FCS F, not numbered and never acknowledged.
+// Return "0" on success or "-1" on error.
+int sendParityFrames(LinkConnection* conn, int count) {
+    unsigned char header[PARITY_HEADER] = {((conn->txCount - 1) / ERASURE_DATA) & 0xFF, count};
+    unsigned char frame[2 * MAX_BODY_SIZE + 5];
+
+    for(int row = 0; row < ERASURE_PARITY; row++) {
+        unsigned char control = PARITY_N | row;
+        unsigned char frameHeader[] = {FLAG_RCV, A_T, control, A_T ^ control};
+        memcpy(frame, frameHeader, 4);
+        int size = encodeBody(conn, header, PARITY_HEADER, conn->txParity[row], conn->txParityLength, frame);
+        if(write(conn->fd, frame, size) < size) {
+            printf("Error writing parity\n");
+            return -1;
         }
-        alarmCount = 0;
+        lineWritten(conn, size);
+        conn->bytesSent += size;
+        if(DEBUG) printf("Parity %d of group %d sent, %d bytes\n", row, header[0], size);
+    }
+    memset(conn->txParity, 0, sizeof(conn->txParity));
+    conn->txParityLength = 0;
+    return 0;
+}
+
+// Adds the payload of the new I-frame in window slot seq to the parity of its group, and sends the parity frames
+// once the group is complete.
+// Return "0" on success or "-1" on error.
+int addToParity(LinkConnection* conn, int seq, int payloadSize) {
+    unsigned char payload[MAX_PAYLOAD_SIZE];
+    unsigned char length[2] = {payloadSize >> 8, payloadSize & 0xFF};
+    destuffBytes(conn->txFrames[seq] + 4, payload, payloadSize);
 
+    int index = conn->txCount % ERASURE_DATA;
+    for(int row = 0; row < ERASURE_PARITY; row++) {
+        unsigned char coefficient = rsErasureCoefficient(row, index, ERASURE_DATA);
+        rsMulAdd(conn->txParity[row], length, 2, coefficient);
+        rsMulAdd(conn->txParity[row] + 2, payload, payloadSize, coefficient);
     }
-    if(nRepeated >= nRetransmissions) {
-        printf("Error sending frame due to max number of retransmissions\n");
+    if(2 + payloadSize > conn->txParityLength) conn->txParityLength = 2 + payloadSize;
+
+    conn->txCount++;
+    if(conn->txCount % ERASURE_DATA == 0) return sendParityFrames(conn, ERASURE_DATA);
+    return 0;
+}
+
+// Waits until the window has room for one more I-frame.
+// Return "0" on success or "-1" on error.
+int waitWindow(LinkConnection* conn) {
+    // I-frames keep flowing until the window is full
+    while(outstanding(conn) >= windowSize()) {
+        if(waitAcknowledgement(conn) == -1) return -1;
+    }
+    return 0;
+}
+
+// Fills in the header of the frame of size bytes (payloadSize before stuffing) encoded in the next window slot
+// and sends it.
+// Return "0" on success or "-1" on error.
+// Unstuffed length of an I-frame body carrying payloadSize bytes: payload, FCS and Reed-Solomon check bytes.
+int bodySize(LinkConnection* conn, int payloadSize) {
+    int size = payloadSize + fcsLength(conn);
+    if(conn->fecStrength > 0) size += rsParitySize(&conn->fecCode, size);
+    return size;
+}
+
+// Writes the header of I-frame ns: F A C BCC1.
+void writeFrameHeader(unsigned char* frame, int ns) {
+    unsigned char control = iControl(ns);
+    unsigned char header[] = { FLAG_RCV, A_T, control, A_T ^ control};
+    memcpy(frame, header, 4);
+}
+
+void llnumberFrame(EncodedFrame *frame, int ns) {
+    writeFrameHeader(frame->data, ns % seqModulo());
+}
+
+int sendNextFrame(LinkConnection* conn, int size, int payloadSize) {
+    int seq = conn->txNext;
+
+    writeFrameHeader(conn->txFrames[seq], seq);
+    conn->txFrameSizes[seq] = size;
+    conn->txSentAt[seq] = 0;
+    conn->txRetransmitted[seq] = FALSE;
+    conn->txPayloadSizes[seq] = payloadSize;
+    conn->txNext = (conn->txNext + 1) % seqModulo();
+
+    if(transmitFrame(conn, seq) == -1) return -1;
+    conn->txFirstSentAt[seq] = conn->txSentAt[seq];
+    conn->stats.framesSent++;
+    conn->stats.stuffedBytes += size - 5 - bodySize(conn, payloadSize);
+    startTimer(conn);
+    if(ERASURE_DATA > 0) return addToParity(conn, seq, payloadSize);
+    return 0;
+}
+
+int llencodeOn(LinkConnection* conn, const unsigned char *header, int headerSize, const unsigned char *data, int dataSize, EncodedFrame *frame) {
+    int bufSize = headerSize + dataSize;
+    if(bufSize > MAX_PAYLOAD_SIZE) {
+        printf("Payload of %d bytes exceeds MAX_PAYLOAD_SIZE\n", bufSize);
         return -1;
     }
-    return bytes;
+    frame->size = encodeBody(conn, header, headerSize, data, dataSize, frame->data);
+    frame->payloadSize = bufSize;
+    return 0;
 }
 
-int sendDataResponse(int valid, unsigned char control) {
-    unsigned char responseC;
-    int accept = FALSE;
-    if(valid) {
-        if(control == frameNumber) {
-            responseC = frameNumber == 0 ? RR1 : RR0;
-            frameNumber ^= 1; 
-            accept = TRUE;
-        } else {
-            responseC = frameNumber == 0 ? RR0 : RR1;
-            accept = FALSE;
+int llwriteEncodedOn(LinkConnection* conn, const EncodedFrame *frame) {
+    if(waitWindow(conn) == -1) return -1;
+    memcpy(conn->txFrames[conn->txNext] + 4, frame->data + 4, frame->size - 4);
+    if(sendNextFrame(conn, frame->size, frame->payloadSize) == -1) return -1;
+    return frame->payloadSize;
+}
+
+int llwritePacketOn(LinkConnection* conn, const unsigned char *header, int headerSize, const unsigned char *data, int dataSize) {
+
+    int bufSize = headerSize + dataSize;
+    if(bufSize > MAX_PAYLOAD_SIZE) {
+        printf("Payload of %d bytes exceeds MAX_PAYLOAD_SIZE\n", bufSize);
+        return -1;
+    }
+
+    if(waitWindow(conn) == -1) return -1;
+
+    int size = encodeBody(conn, header, headerSize, data, dataSize, conn->txFrames[conn->txNext]);
+    if(sendNextFrame(conn, size, bufSize) == -1) return -1;
+
+    return bufSize;
+}
+
+int llwriteOn(LinkConnection* conn, const unsigned char *buf, int bufSize) {
+    return llwritePacketOn(conn, buf, bufSize, NULL, 0);
+}
+
+int llflushOn(LinkConnection* conn) {
+    while(outstanding(conn) > 0) {
+        if(waitAcknowledgement(conn) == -1) return -1;
+    }
+    return 0;
+}
+
+// Called for each damaged or out of order frame offset frames past rxExpected.
+// Return whether the gap is left to the parity of the group, instead of REJ or SREJ.
+// The parity follows the last frame of the group, so a frame from the next group means it did not help,
+// and a frame at or before the furthest one seen means the sender went back, parity is only sent once.
+int parityPending(LinkConnection* conn, int offset) {
+    if(ERASURE_DATA == 0) return FALSE;
+    long group = conn->rxCount / ERASURE_DATA;
+    long frame = conn->rxCount + offset;
+    if(frame / ERASURE_DATA != group || frame <= conn->rxHighest) conn->rxGroupSettled = group;
+    if(frame > conn->rxHighest) conn->rxHighest = frame;
+    return conn->rxGroupSettled != group;
+}
+
+// Asks for the frame in gap seq with an SREJ, once per gap.
+// Return "0" on success or "-1" on error.
+int requestFrame(LinkConnection* conn, int seq) {
+    if(conn->rxSrejSent[seq]) return 0;
+    conn->rxSrejSent[seq] = TRUE;
+    if(DEBUG) printf("SREJ%d sent\n", seq);
+    return sendSupervision(conn, SREJ_N | seq);
+}
+
+int sendDataResponse(LinkConnection* conn, int valid, int ns, const unsigned char* packet, int size) {
+    int offset = seqDistance(conn->rxExpected, ns);
+    int inWindow = offset < windowSize();
+
+    if(!valid) {
+        conn->errorsReceived++;
+        if(!inWindow) {
+            if(DEBUG) printf("error received, RR%d sent\n", conn->rxExpected);
+            return sendSupervision(conn, rrControl(conn->rxExpected));
         }
-        if(DEBUG) printf("packet received, RR%d sent\n", responseC == RR0 ? 0 : 1);
-    } else {
-        if(control == frameNumber) {
-            if(DEBUG) printf("error received, REJ%d sent\n", frameNumber);
-            responseC = frameNumber == 0 ? REJ0 : REJ1;
-            accept = FALSE;
+        if(parityPending(conn, offset)) {
+            if(DEBUG) printf("error received, waiting for parity\n");
+            return FALSE;
+        }
+        if(ARQ_MODE == ARQ_SELECTIVE_REPEAT) {
+            if(conn->rxBuffered[ns]) return FALSE;
+            // a damaged copy of a frame already asked for means the last SREJ was answered
+            conn->rxSrejSent[ns] = FALSE;
+            if(DEBUG) printf("error received\n");
+            return requestFrame(conn, ns);
+        }
+        // a damaged expected frame is always rejected, a damaged later one only opens a REJ once
+        if(offset > 0 && conn->rejSent) return FALSE;
+        conn->rejSent = TRUE;
+        if(DEBUG) printf("error received, REJ%d sent\n", conn->rxExpected);
+        return sendSupervision(conn, rejControl(conn->rxExpected));
+    }
+
+    if(offset == 0) {
+        // kept for rebuilding the rest of its group
+        if(ERASURE_DATA > 0) {
+            memcpy(conn->rxFrames[ns], packet, size);
+            conn->rxFrameSizes[ns] = size;
+        }
+        conn->rxSrejSent[ns] = FALSE;
+        conn->rxExpected = (conn->rxExpected + 1) % seqModulo();
+        conn->rxCount++;
+        conn->rejSent = FALSE;
+        conn->stats.framesReceived++;
+        goodputRecord(&conn->stats.goodput, nowMicros(), size);
+        if(DEBUG) printf("packet received, RR%d sent\n", conn->rxExpected);
+        if(sendSupervision(conn, rrControl(conn->rxExpected)) == -1) return -1;
+        return TRUE;
+    }
+
+    if(!inWindow) {
+        conn->stats.duplicates++;
+        if(DEBUG) printf("duplicate received, RR%d sent\n", conn->rxExpected);
+        return sendSupervision(conn, rrControl(conn->rxExpected));
+    }
+
+    // go-back-n keeps them too when parity may fill the gap
+    if(ARQ_MODE == ARQ_SELECTIVE_REPEAT || ERASURE_DATA > 0) {
+        if(!conn->rxBuffered[ns]) {
+            memcpy(conn->rxFrames[ns], packet, size);
+            conn->rxFrameSizes[ns] = size;
+            conn->rxBuffered[ns] = TRUE;
+            conn->rxSrejSent[ns] = FALSE;
+            if(DEBUG) printf("I%d buffered out of order\n", ns);
         } else {
-            if(DEBUG) printf("error received, RR%d sent\n", frameNumber);
-            responseC = frameNumber == 0 ? RR0 : RR1;
-            accept = FALSE;
+            conn->stats.duplicates++;
         }
-        errorsReceived++;
     }
-    unsigned char response[] = {FLAG_RCV, A_T, responseC, A_T ^ responseC, FLAG_RCV};
-    int bytes = write(fd, response, 5);
-    if(bytes < 5) {
-        printf("Error writing response\n");
-        return -1;
+    if(parityPending(conn, offset)) return FALSE;
+
+    if(ARQ_MODE == ARQ_SELECTIVE_REPEAT) {
+        // ask for every gap before this frame not asked for yet
+        for(int seq = conn->rxExpected; seq != ns; seq = (seq + 1) % seqModulo()) {
+            if(!conn->rxBuffered[seq] && requestFrame(conn, seq) == -1) return -1;
+        }
+        return FALSE;
     }
-    bytesSent += bytes;
-    if(DEBUG) printf("%d bytes data response written\n", bytes);
-    return accept;
-}                      
-    
+
+    if(!conn->rejSent) {
+        conn->rejSent = TRUE;
+        if(DEBUG) printf("out of order received, REJ%d sent\n", conn->rxExpected);
+        return sendSupervision(conn, rejControl(conn->rxExpected));
+    }
+    return FALSE;
+}
+
+// Sequence number of frame index of the group holding rxExpected.
+int groupSeq(LinkConnection* conn, int index) {
+    return (conn->rxExpected + index - conn->rxCount % ERASURE_DATA + SEQ_MODULO) % SEQ_MODULO;
+}
+
+// Whether the receiver still has frame index of the group holding rxExpected, handed over or buffered.
+int groupHas(LinkConnection* conn, int index) {
+    int offset = index - conn->rxCount % ERASURE_DATA;
+    return offset < 0 || (offset > 0 && conn->rxBuffered[groupSeq(conn, index)]);
+}
+
+// Parity did not rebuild the group holding rxExpected, asks for its missing frames the usual way.
+// Return "0" on success or "-1" on error.
+int settleGroup(LinkConnection* conn, const int* missing, int nMissing) {
+    conn->rxGroupSettled = conn->rxCount / ERASURE_DATA;
+    if(ARQ_MODE == ARQ_SELECTIVE_REPEAT) {
+        for(int i = 0; i < nMissing; i++) {
+            if(DEBUG) printf("parity not enough for I%d\n", groupSeq(conn, missing[i]));
+            if(requestFrame(conn, groupSeq(conn, missing[i])) == -1) return -1;
+        }
+        return 0;
+    }
+    if(conn->rejSent) return 0;
+    conn->rejSent = TRUE;
+    if(DEBUG) printf("parity not enough, REJ%d sent\n", conn->rxExpected);
+    return sendSupervision(conn, rejControl(conn->rxExpected));
+}
+
+// Takes a parity frame of size bytes for the group holding rxExpected and rebuilds the frames missing from it
+// (into the out of order buffer) once there are as many parity frames as gaps.
+// Return "0" on success or "-1" on error.
+int receiveParity(LinkConnection* conn, int row, const unsigned char* body, int size) {
+    long group = conn->rxCount / ERASURE_DATA;
+    int count = body[1];
+    int length = size - PARITY_HEADER;
+    // parity of a group already handed over, or of one not reached yet, is of no use
+    if(size <= PARITY_HEADER + 2 || body[0] != (group & 0xFF) || count < 1 || count > ERASURE_DATA ||
+       row >= ERASURE_PARITY || conn->rxGroupSettled == group) return 0;
+
+    if(conn->rxParityGroup != group) {
+        memset(conn->rxParityPresent, 0, sizeof(conn->rxParityPresent));
+        conn->rxParityGroup = group;
+    }
+    memcpy(conn->rxParity[row], body + PARITY_HEADER, length);
+    conn->rxParityPresent[row] = TRUE;
+
+    int missing[MAX_PARITY_ROWS + 1];
+    int nMissing = 0;
+    for(int i = conn->rxCount % ERASURE_DATA; i < count; i++) {
+        if(groupHas(conn, i)) continue;
+        if(nMissing == MAX_PARITY_ROWS) return settleGroup(conn, missing, nMissing);
+        missing[nMissing++] = i;
+    }
+    if(nMissing == 0) return 0;
+
+    int rows[MAX_PARITY_ROWS];
+    int nRows = 0;
+    for(int r = 0; r < ERASURE_PARITY && nRows < nMissing; r++) {
+        if(conn->rxParityPresent[r]) rows[nRows++] = r;
+    }
+    if(nRows < nMissing) {
+        // later rows may still come
+        if(row < ERASURE_PARITY - 1) return 0;
+        return settleGroup(conn, missing, nMissing);
+    }
+
+    // take out what the frames at hand put into the parity, the rest is the missing frames
+    unsigned char* syndromes[MAX_PARITY_ROWS];
+    unsigned char* rebuilt[MAX_PARITY_ROWS];
+    for(int a = 0; a < nMissing; a++) {
+        syndromes[a] = conn->rxSyndromes[a];
+        rebuilt[a] = conn->rxRebuilt[a];
+        memcpy(syndromes[a], conn->rxParity[rows[a]], length);
+        for(int i = 0; i < count; i++) {
+            if(!groupHas(conn, i)) continue;
+            int seq = groupSeq(conn, i);
+            unsigned char frameLength[2] = {conn->rxFrameSizes[seq] >> 8, conn->rxFrameSizes[seq] & 0xFF};
+            if(2 + conn->rxFrameSizes[seq] > length) return settleGroup(conn, missing, nMissing);
+            unsigned char coefficient = rsErasureCoefficient(rows[a], i, ERASURE_DATA);
+            rsMulAdd(syndromes[a], frameLength, 2, coefficient);
+            rsMulAdd(syndromes[a] + 2, conn->rxFrames[seq], conn->rxFrameSizes[seq], coefficient);
+        }
+    }
+    if(rsSolveErasures(syndromes, rows, missing, nMissing, ERASURE_DATA, length, rebuilt) != 0) {
+        return settleGroup(conn, missing, nMissing);
+    }
+
+    for(int a = 0; a < nMissing; a++) {
+        int frameSize = (rebuilt[a][0] << 8) | rebuilt[a][1];
+        if(frameSize > length - 2 || frameSize > MAX_PAYLOAD_SIZE) return settleGroup(conn, missing, nMissing);
+    }
+    for(int a = 0; a < nMissing; a++) {
+        int seq = groupSeq(conn, missing[a]);
+        conn->rxFrameSizes[seq] = (rebuilt[a][0] << 8) | rebuilt[a][1];
+        memcpy(conn->rxFrames[seq], rebuilt[a] + 2, conn->rxFrameSizes[seq]);
+        conn->rxBuffered[seq] = TRUE;
+        conn->rxSrejSent[seq] = FALSE;
+        conn->framesRebuilt++;
+        if(DEBUG) printf("I%d rebuilt from parity\n", seq);
+    }
+    conn->rxGroupSettled = group;
+    return 0;
+}
+
+// Moves the clean run at the head of the receive ring into dst (at most room bytes) and XORs it into bcc2.
+// Return number of bytes moved.
+int takeCleanRun(LinkConnection* conn, unsigned char* dst, int room, unsigned char* bcc2) {
+    unsigned int offset = conn->rxRingHead & (RX_RING_SIZE - 1);
+    int available = conn->rxRingTail - conn->rxRingHead;
+    if(available > RX_RING_SIZE - offset) available = RX_RING_SIZE - offset;
+    if(available > room) available = room;
+    int moved = copyCleanRun(&conn->rxRing[offset], available, dst, bcc2);
+    conn->rxRingHead += moved;
+    return moved;
+}
+
 ////////////////////////////////////////////////
 // LLREAD
 ////////////////////////////////////////////////
-int llread(unsigned char *packet) {
+// Reads frames from conn until one hands over a packet, as llreadOn does.
+int readPacket(LinkConnection* conn, unsigned char *packet) {
+
+    // frames received ahead of a gap are handed over once it is filled
+    if(conn->rxBuffered[conn->rxExpected]) {
+        int seq = conn->rxExpected;
+        int size = conn->rxFrameSizes[seq];
+        memcpy(packet, conn->rxFrames[seq], size);
+        packet[size] = '\0';
+        conn->rxBuffered[seq] = FALSE;
+        conn->rxSrejSent[seq] = FALSE;
+        conn->rxExpected = (conn->rxExpected + 1) % seqModulo();
+        conn->rxCount++;
+        conn->stats.framesReceived++;
+        goodputRecord(&conn->stats.goodput, nowMicros(), size);
+        if(sendSupervision(conn, rrControl(conn->rxExpected)) == -1) return -1;
+        return size;
+    }
     
     State state = START;
     int stop = FALSE;
@@ -428,12 +1592,31 @@ int llread(unsigned char *packet) {
     unsigned char bcc2 = 0;
     unsigned char buf;
     unsigned char control;
+    // with FEC (or for parity frames) the body is taken in on the side and only the payload is copied to packet
+    unsigned char* body = packet;
+    int limit = conn->rxBodyLimit;
 
     while(stop == FALSE) {
 
-        int bytes = read(fd, &buf, 1);
-        if(bytes < 1) continue;
-        bytesReceived += bytes;
+        // payload spans without FLAG or ESC go straight from the ring into the body
+        if(state == D) {
+            index += takeCleanRun(conn, &body[index], limit - index, &bcc2);
+        }
+
+        if(readByte(conn, &buf) == FALSE) {
+            if(conn->timerExpired && conn->idleFrom >= 0) {
+                if(conn->bytesReceived == conn->idleFrom) {
+                    printf("Nothing received for %lld s, the transmitter is gone\n", conn->idleLimit / 1000000);
+                    return -1;
+                }
+                conn->idleFrom = conn->bytesReceived;
+                armTimer(conn, conn->idleLimit);
+                continue;
+            }
+            if(!conn->interrupted) continue;
+            conn->interrupted = FALSE;
+            return 0;
+        }
 
         switch (state) {
             case START: 
@@ -464,6 +1647,10 @@ int llread(unsigned char *packet) {
             case C:
                 if(buf == (A_T ^ control)) {
                     state = D;
+                    index = 0;
+                    bcc2 = 0;
+                    body = conn->fecStrength > 0 || isParityControl(control) ? conn->rxBody : packet;
+                    limit = isParityControl(control) ? MAX_BODY_SIZE : conn->rxBodyLimit;
                 }
                 else if(buf == FLAG_RCV) {
                     state = FLAG;
@@ -474,30 +1661,65 @@ int llread(unsigned char *packet) {
                 break;
             case D:
                 if(buf == FLAG_RCV) {
-                    unsigned char bcc2Received = packet[--index];
-                    bcc2 ^= bcc2Received;
-                    packet[index] = '\0';
-                    int accept = sendDataResponse(bcc2Received == bcc2, control == CI_0 ? 0 : 1);
+                    if(control == C_DISC && index == 0) {
+                        // the transmitter gave up or is done, nothing more will come
+                        printf("Link closed by the transmitter\n");
+                        conn->discReceived = TRUE;
+                        return -1;
+                    }
+                    if(index <= fcsLength(conn)) {
+                        // no payload, this flag opens the next frame
+                        state = FLAG;
+                        break;
+                    }
+                    if(conn->fecStrength > 0) {
+                        index = rsDecode(&conn->fecCode, body, index, &conn->fecCorrected);
+                        bcc2 = 0;
+                        if(conn->fcsMode == FCS_BCC) {
+                            for(int i = 0; i < index; i++) bcc2 ^= body[i];
+                        }
+                    }
+                    int valid = index > fcsLength(conn);
+                    index = valid ? index - fcsLength(conn) : 0;
+                    valid = valid && checkFcs(conn, body, index, bcc2);
+                    if(isParityControl(control)) {
+                        if(valid && receiveParity(conn, control & SEQ_MASK, body, index) == -1) return -1;
+                        // a rebuilt frame is handed over like one received out of order
+                        if(conn->rxBuffered[conn->rxExpected]) return readPacket(conn, packet);
+                        state = FLAG;
+                        break;
+                    }
+                    valid = valid && index <= MAX_PAYLOAD_SIZE;
+                    int accept = sendDataResponse(conn, valid, controlSeq(control), body, index);
                     if(accept == -1) {
                         return -1;
                     }
                     if(accept == TRUE) {
+                        if(body != packet) memcpy(packet, body, index);
+                        packet[index] = '\0';
                         stop = TRUE;
                     }
                     else {
-                        state = START;
-                        index = 0;
-                        bcc2 = 0;
+                        // after a frame cut short this flag may open the next one
+                        state = FLAG;
                     }   
+                } else if (index >= limit) {
+                    // longer than any valid frame, drop it
+                    state = START;
                 } else if (buf == ESC) {
                     state = DD;
                 } else {
-                    packet[index++] = buf;
+                    body[index++] = buf;
                     bcc2 ^= buf;
                 }
                 break;
             case DD:
-                packet[index++] = buf ^ ESC_XOR;
+                if(buf == FLAG_RCV) {
+                    // never stuffed, so the frame was cut short and this flag opens the next one
+                    state = FLAG;
+                    break;
+                }
+                body[index++] = buf ^ ESC_XOR;
                 bcc2 ^= buf ^ ESC_XOR;
                 state = D;
                 break;
@@ -510,10 +1732,24 @@ int llread(unsigned char *packet) {
     return index;
 }
 
-int sendDISC() {
-    unsigned char disc[] = {FLAG_RCV, role == LlTx ? A_T : A_R, C_DISC,(role == LlTx ? A_T : A_R) ^ C_DISC, FLAG_RCV};
-    int bytes = write(fd, disc, 5);
-    bytesSent += bytes;
+int llreadOn(LinkConnection* conn, unsigned char *packet) {
+    // the retransmission timer of replies not yet acknowledged is left to run
+    if(conn->idleLimit > 0 && !conn->timerArmed) {
+        conn->idleFrom = conn->bytesReceived;
+        armTimer(conn, conn->idleLimit);
+    }
+    int bytes = readPacket(conn, packet);
+    if(conn->idleFrom >= 0) {
+        stopTimer(conn);
+        conn->idleFrom = -1;
+    }
+    return bytes;
+}
+
+int sendDISC(LinkConnection* conn) {
+    unsigned char disc[] = {FLAG_RCV, conn->role == LlTx ? A_T : A_R, C_DISC,(conn->role == LlTx ? A_T : A_R) ^ C_DISC, FLAG_RCV};
+    int bytes = write(conn->fd, disc, 5);
+    conn->bytesSent += bytes;
     if(bytes < 5) {
         printf("Error writing DISC\n");
         return -1;
@@ -525,78 +1761,305 @@ int sendDISC() {
 ////////////////////////////////////////////////
 // LLCLOSE
 ////////////////////////////////////////////////
-int llclose(int showStatistics) {
+// Hands the statistics of conn over to the JSON report the application writes at the end.
+void reportStatistics(LinkConnection* conn) {
+    char* json = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&json, &size);
+    if(out == NULL) return;
+    LinkStats* stats = &conn->stats;
+
+    fprintf(out, "{\"port\": \"%s\", \"elapsed_s\": %.6f, ", conn->port, (nowMicros() - stats->openedAt) / 1e6);
+    fprintf(out, "\"bytes_sent\": %ld, \"bytes_received\": %ld, \"frames_sent\": %ld, \"frames_received\": %ld, ",
+            conn->bytesSent, conn->bytesReceived, stats->framesSent, stats->framesReceived);
+    fprintf(out, "\"retransmissions\": %ld, \"timeouts\": %ld, \"rej_sent\": %ld, \"rej_received\": %ld, ",
+            stats->retransmissions, stats->timeouts, stats->rejSent, stats->rejReceived);
+    fprintf(out, "\"srej_sent\": %ld, \"srej_received\": %ld, \"duplicates\": %ld, \"stuffed_bytes\": %ld, ",
+            stats->srejSent, stats->srejReceived, stats->duplicates, stats->stuffedBytes);
+    fprintf(out, "\"error_frames_sent\": %d, \"error_frames_received\": %d, \"fec_corrected_bytes\": %d, ",
+            conn->errorsSent, conn->errorsReceived, conn->fecCorrected);
+    fprintf(out, "\"frames_rebuilt\": %d, \"srtt_ms\": %.3f, \"rto_ms\": %d, ", conn->framesRebuilt, conn->srtt, conn->rto);
+    fprintf(out, "\"rtt_us\": ");
+    histogramJson(out, &stats->rtt);
+    fprintf(out, ", \"ack_latency_us\": ");
+    histogramJson(out, &stats->ackLatency);
+    fprintf(out, ", \"retransmit_delay_us\": ");
+    histogramJson(out, &stats->retransmitDelay);
+    fprintf(out, ", \"goodput\": ");
+    goodputJson(out, &stats->goodput);
+    fprintf(out, "}");
+
+    if(fclose(out) == 0) statsReportLink(json);
+    else free(json);
+}
+
+// Exchanges DISC and UA with the other end and prints the statistics if asked to.
+// Return "0" on success or "-1" on error.
+int closeConnection(LinkConnection* conn, int showStatistics) {
     int stop = FALSE;
     State state = START;
     int index = 0;
-    unsigned char received[5] = {0};
+    unsigned char received[7] = {0};
     unsigned char ua_reply[] = {FLAG_RCV, A_T, C_UA, A_T ^ C_UA, FLAG_RCV};
-    
-    switch (role) {
+    int nRepeated = 0;
+    // DISC and UA are waited for as long as SET and UA in llopen, the RTO only fits I-frames
+    int rto = conn->rto;
+    conn->rto = conn->timout * 1000;
+
+    switch (conn->role) {
         case LlTx:
-            while(stop == FALSE) {
-                if(sendDISC() == -1) {
+            // parity of the last, short group covers the tail of the transfer
+            if(ERASURE_DATA > 0 && conn->txCount % ERASURE_DATA != 0 && sendParityFrames(conn, conn->txCount % ERASURE_DATA) == -1) {
+                return -1;
+            }
+            // after frames that were never acknowledged the receiver still learns that nothing more comes
+            int flushed = llflushOn(conn);
+            while(stop == FALSE && nRepeated < conn->nRetransmissions) {
+                if(sendDISC(conn) == -1) {
                     printf("Error sending DISC\n");
                     return -1;
                 }
-                while(stop == FALSE && alarmCount < timout) {
-                    if (alarmEnabled == FALSE) {
-                        alarm(1); // Set alarm to be triggered in 1s
-                        alarmEnabled = TRUE;
-                    }
-                    stop = parseFrame(CLOSETX, &state, received, &index);
+                startTimer(conn);
+                while (stop == FALSE && conn->timerExpired == FALSE) {
+                    stop = parseFrame(conn, CLOSETX, &state, received, &index);
                 }
-                
-                alarmCount = 0;
+                stopTimer(conn);
+                nRepeated++;
             }
-            if(stop == TRUE){
-                if(DEBUG) printf("DISC received\n");
-                if(write(fd, ua_reply, 5) < 5) {
-                    printf("Error writing UA\n");
-                    return -1;
-                }
-                bytesSent += 5;
+            if(stop == FALSE) {
+                printf("Error closing, no DISC from the receiver\n");
+                return -1;
+            }
+            if(DEBUG) printf("DISC received\n");
+            if(write(conn->fd, ua_reply, 5) < 5) {
+                printf("Error writing UA\n");
+                return -1;
             }
+            conn->bytesSent += 5;
+            if(flushed == -1) return -1;
             break;
         case LlRx:  
-            while (stop == FALSE) {
-                stop = parseFrame(CLOSERX, &state, received, &index);
+            // llread may have taken the DISC already
+            stop = conn->discReceived;
+            while (stop == FALSE && nRepeated < conn->nRetransmissions) {
+                long before = conn->bytesReceived;
+                startTimer(conn);
+                while (stop == FALSE && conn->timerExpired == FALSE) {
+                    stop = parseFrame(conn, CLOSERX, &state, received, &index);
+                    if(stop == TRUE && isIControl(received[2])) {
+                        // the acknowledgement of the last frame was lost, the transmitter sends it again
+                        if(DEBUG) printf("I%d received again, RR%d sent\n", controlSeq(received[2]), conn->rxExpected);
+                        if(sendSupervision(conn, rrControl(conn->rxExpected)) == -1) return -1;
+                        stop = FALSE;
+                        state = START;
+                        index = 0;
+                    }
+                }
+                stopTimer(conn);
+                // copies sent before the DISC are still arriving, the DISC is queued behind them
+                if(conn->bytesReceived == before) nRepeated++;
+            }
+            if(stop == FALSE) {
+                printf("Error closing, no DISC from the transmitter\n");
+                return -1;
             }
             stop = FALSE;
-            while (stop == FALSE)
+            nRepeated = 0;
+            state = START;
+            index = 0;
+            while (stop == FALSE && nRepeated < conn->nRetransmissions)
             {
-                if(sendDISC() == -1) {
+                if(sendDISC(conn) == -1) {
                     printf("Error sending DISC\n");
                     return -1;
                 }
-                while (stop == FALSE && alarmCount < timout) {
-                    if (alarmEnabled == FALSE) {
-                        alarm(1); // Set alarm to be triggered in 1s
-                        alarmEnabled = TRUE;
-                    }
-                    stop = parseFrame(RCV_UA, &state, received, &index); // RECEIVES UA
+                startTimer(conn);
+                while (stop == FALSE && conn->timerExpired == FALSE) {
+                    stop = parseFrame(conn, RCV_UA, &state, received, &index); // RECEIVES UA
                 }
-                alarmCount = 0;
+                stopTimer(conn);
+                nRepeated++;
+            }
+            if(stop == FALSE) {
+                printf("Error closing, no UA from the transmitter\n");
+                return -1;
             }
             break;
         default:
             break;
     }
-
+    conn->rto = rto;
 
     if(showStatistics) {
-        printf("Error frames sent: %d\n", errorsSent);
-        printf("Error frames received: %d\n", errorsReceived);
-        printf("Total Bytes Sent: %ld\n", bytesSent);
-        printf("Total Bytes Received: %ld\n", bytesReceived);
+        printf("Error frames sent: %d\n", conn->errorsSent);
+        printf("Error frames received: %d\n", conn->errorsReceived);
+        printf("Total Bytes Sent: %ld\n", conn->bytesSent);
+        printf("Total Bytes Received: %ld\n", conn->bytesReceived);
+        if(conn->fecStrength > 0) printf("Bytes corrected by FEC: %d\n", conn->fecCorrected);
+        if(ERASURE_DATA > 0) printf("Frames rebuilt from parity: %d\n", conn->framesRebuilt);
+        if(conn->rttSamples > 0) printf("Smoothed RTT: %.3f ms (final RTO %d ms)\n", conn->srtt, conn->rto);
+        printf("Retransmissions: %ld (%ld timeouts, %ld REJ and %ld SREJ received)\n", conn->stats.retransmissions,
+               conn->stats.timeouts, conn->stats.rejReceived, conn->stats.srejReceived);
+        printf("REJ sent: %ld, SREJ sent: %ld, duplicates received: %ld\n", conn->stats.rejSent, conn->stats.srejSent,
+               conn->stats.duplicates);
+        printf("Bytes added by stuffing: %ld\n", conn->stats.stuffedBytes);
+        if(conn->stats.ackLatency.count > 0) {
+            printf("Acknowledgement latency: p50 %lld us, p99 %lld us, max %lld us\n",
+                   histogramPercentile(&conn->stats.ackLatency, 50), histogramPercentile(&conn->stats.ackLatency, 99),
+                   conn->stats.ackLatency.max);
+        }
+        reportStatistics(conn);
     }
+    return 0;
+}
 
-    if (tcsetattr(fd, TCSANOW, &oldtio) == -1) {
+// Restores the port settings and frees conn.
+void releaseConnection(LinkConnection* conn) {
+    if (conn->termiosSaved && tcsetattr(conn->fd, TCSANOW, &conn->oldtio) == -1) {
         perror("tcsetattr");
-        exit(-1);
-        }
+    }
+    if(conn->fd >= 0) close(conn->fd);
+    if(conn->timerFd >= 0) close(conn->timerFd);
+    if(conn->wakeFd >= 0) close(conn->wakeFd);
+    free(conn);
+}
 
-    close(fd);
-    
+LinkConnection* llconnect(LinkLayer connectionParameters) {
+    LinkConnection* conn = calloc(1, sizeof(LinkConnection));
+    if(conn == NULL) {
+        printf("Failed to allocate connection\n");
+        return NULL;
+    }
+    conn->fd = -1;
+    conn->timerFd = -1;
+    conn->wakeFd = -1;
+    conn->fcsMode = FCS_BCC;
+    if(openConnection(conn, connectionParameters) != 0) {
+        releaseConnection(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+LinkConnection* llconnectMemory(LinkLayerRole role, const unsigned char *input, long size, int output) {
+    if(checkSettings() != 0) return NULL;
+    LinkConnection* conn = calloc(1, sizeof(LinkConnection));
+    if(conn == NULL) {
+        printf("Failed to allocate connection\n");
+        return NULL;
+    }
+    conn->timerFd = -1;
+    conn->wakeFd = -1;
+    conn->fd = output >= 0 ? dup(output) : open("/dev/null", O_WRONLY);
+    if(conn->fd < 0) {
+        perror("output");
+        free(conn);
+        return NULL;
+    }
+    conn->role = role;
+    resetConnection(conn);
+    strcpy(conn->port, "memory");
+    conn->input = input;
+    conn->inputSize = size;
+
+    pthread_once(&crcTablesOnce, buildCrcTables);
+    conn->fcsMode = FCS_MODE;
+    conn->fecStrength = FCS_MODE == FCS_BCC ? 0 : FEC_STRENGTH;
+    applyNegotiation(conn);
+    return conn;
+}
+
+int lldisconnect(LinkConnection* conn, int showStatistics) {
+    int result = closeConnection(conn, showStatistics);
+    releaseConnection(conn);
+    return result;
+}
+
+void llabandon(LinkConnection* conn) {
+    releaseConnection(conn);
+}
+
+void llinterrupt(LinkConnection* conn) {
+    uint64_t one = 1;
+    if(write(conn->wakeFd, &one, sizeof(one)) != sizeof(one)) perror("eventfd");
+}
+
+int lloutstandingOn(LinkConnection* conn) {
+    return outstanding(conn);
+}
+
+long long lllineFreeAtOn(LinkConnection* conn) {
+    return conn->lineFreeAt;
+}
+
+double llbyteTimeOn(LinkConnection* conn) {
+    return conn->byteTime;
+}
+
+// The original interface, on one connection per process
+
+int llopen(LinkLayer connectionParameters) {
+    if(defaultConnection != NULL || defaultBond != NULL) {
+        printf("Connection already open\n");
+        return -1;
+    }
+    if(strchr(connectionParameters.serialPort, ',') != NULL) {
+        defaultBond = bondOpen(connectionParameters);
+        return defaultBond == NULL ? -1 : 0;
+    }
+    defaultConnection = llconnect(connectionParameters);
+    if(defaultConnection == NULL) return -1;
+    // llread gives up once the transmitter has been silent for longer than it keeps sending a frame again
+    defaultConnection->idleLimit = (long long)connectionParameters.timeout * (connectionParameters.nRetransmissions + 1) * 1000000;
     return 0;
 }
+
+int llpayloadLimit() {
+    return defaultBond != NULL ? MAX_PAYLOAD_SIZE - BOND_HEADER : MAX_PAYLOAD_SIZE;
+}
+
+int llencode(const unsigned char *header, int headerSize, const unsigned char *data, int dataSize, EncodedFrame *frame) {
+    if(defaultBond != NULL) return bondEncode(defaultBond, header, headerSize, data, dataSize, frame);
+    return llencodeOn(defaultConnection, header, headerSize, data, dataSize, frame);
+}
+
+int llwriteEncoded(const EncodedFrame *frame) {
+    if(defaultBond != NULL) return bondWriteEncoded(defaultBond, frame);
+    return llwriteEncodedOn(defaultConnection, frame);
+}
+
+int llwritePacket(const unsigned char *header, int headerSize, const unsigned char *data, int dataSize) {
+    if(defaultBond != NULL) return bondWritePacket(defaultBond, header, headerSize, data, dataSize);
+    return llwritePacketOn(defaultConnection, header, headerSize, data, dataSize);
+}
+
+int llwrite(const unsigned char *buf, int bufSize) {
+    return llwritePacket(buf, bufSize, NULL, 0);
+}
+
+int llflush() {
+    if(defaultBond != NULL) return bondFlush(defaultBond);
+    return llflushOn(defaultConnection);
+}
+
+double llframeErrorRate() {
+    if(defaultBond != NULL) return bondFrameErrorRate(defaultBond);
+    return llframeErrorRateOn(defaultConnection);
+}
+
+int llread(unsigned char *packet) {
+    if(defaultBond != NULL) return bondRead(defaultBond, packet);
+    return llreadOn(defaultConnection, packet);
+}
+
+int llclose(int showStatistics) {
+    if(defaultBond != NULL) {
+        int result = bondClose(defaultBond, showStatistics);
+        defaultBond = NULL;
+        return result;
+    }
+    if(defaultConnection == NULL) return -1;
+    int result = lldisconnect(defaultConnection, showStatistics);
+    defaultConnection = NULL;
+    return result;
+}
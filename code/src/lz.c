@@ -0,0 +1,140 @@
+// LZ77 block codec implementation
+
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define HASH_BITS 11
+#define LAST_LITERALS 5 // the block always ends with a few literals, matches never read past size - LAST_LITERALS
+
+unsigned int lzHash(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Writes a count that did not fit its nibble as 255s and a remainder.
+// Return the new output index, or "-1" past capacity.
+int writeLength(unsigned char *dst, int out, int capacity, int length) {
+    while(length >= 255) {
+        if(out >= capacity) return -1;
+        dst[out++] = 255;
+        length -= 255;
+    }
+    if(out >= capacity) return -1;
+    dst[out++] = length;
+    return out;
+}
+
+// Emits one sequence: literals src[anchor..anchor + literals) then, if matchLength > 0, the match.
+// Return the new output index, or "-1" past capacity.
+int writeSequence(const unsigned char *src, int anchor, int literals, int offset, int matchLength,
+                  unsigned char *dst, int out, int capacity) {
+    int extraMatch = matchLength > 0 ? matchLength - MIN_MATCH : 0;
+    if(out >= capacity) return -1;
+    int token = out++;
+    dst[token] = (literals < 15 ? literals : 15) << 4 | (extraMatch < 15 ? extraMatch : 15);
+
+    if(literals >= 15 && (out = writeLength(dst, out, capacity, literals - 15)) < 0) return -1;
+    if(out + literals > capacity) return -1;
+    memcpy(dst + out, src + anchor, literals);
+    out += literals;
+
+    if(matchLength == 0) return out;
+    if(out + 2 > capacity) return -1;
+    dst[out++] = offset & 0xFF;
+    dst[out++] = offset >> 8;
+    if(extraMatch >= 15 && (out = writeLength(dst, out, capacity, extraMatch - 15)) < 0) return -1;
+    return out;
+}
+
+int lzCompress(const unsigned char *src, int size, unsigned char *dst, int capacity) {
+    if(size < 0 || size > LZ_MAX_INPUT) return -1;
+
+    uint16_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    int anchor = 0;
+    int out = 0;
+    int pos = 1; // position 0 is what empty table entries point at
+    int limit = size - LAST_LITERALS - MIN_MATCH;
+
+    if(size > 0 && limit > 0) table[lzHash(src)] = 0;
+    while(pos < limit) {
+        unsigned int h = lzHash(src + pos);
+        int candidate = table[h];
+        table[h] = pos;
+        if(memcmp(src + candidate, src + pos, MIN_MATCH) != 0) {
+            // skip faster through data that does not match
+            pos += 1 + ((pos - anchor) >> 5);
+            continue;
+        }
+
+        // extend backwards over literals and forwards up to the tail
+        while(pos > anchor && candidate > 0 && src[pos - 1] == src[candidate - 1]) {
+            pos--;
+            candidate--;
+        }
+        int length = MIN_MATCH;
+        while(pos + length < size - LAST_LITERALS && src[pos + length] == src[candidate + length]) length++;
+
+        out = writeSequence(src, anchor, pos - anchor, pos - candidate, length, dst, out, capacity);
+        if(out < 0) return -1;
+
+        pos += length;
+        anchor = pos;
+        if(pos - 2 > 0 && pos - 2 < limit) table[lzHash(src + pos - 2)] = pos - 2;
+    }
+
+    return writeSequence(src, anchor, size - anchor, 0, 0, dst, out, capacity);
+}
+
+// Reads a count continued past its nibble.
+// Return the new input index, or "-1" past the end of the input.
+int readLength(const unsigned char *src, int in, int size, int *length) {
+    unsigned char b;
+    do {
+        if(in >= size) return -1;
+        b = src[in++];
+        *length += b;
+    } while(b == 255);
+    return in;
+}
+
+int lzDecompress(const unsigned char *src, int size, unsigned char *dst, int capacity) {
+    int in = 0;
+    int out = 0;
+
+    while(in < size) {
+        int token = src[in++];
+
+        int literals = token >> 4;
+        if(literals == 15 && (in = readLength(src, in, size, &literals)) < 0) return -1;
+        if(in + literals > size || out + literals > capacity) return -1;
+        memcpy(dst + out, src + in, literals);
+        in += literals;
+        out += literals;
+
+        if(in == size) break; // last sequence, literals only
+
+        if(in + 2 > size) return -1;
+        int offset = src[in] | src[in + 1] << 8;
+        in += 2;
+        int length = token & 0x0F;
+        if(length == 15 && (in = readLength(src, in, size, &length)) < 0) return -1;
+        length += MIN_MATCH;
+
+        if(offset == 0 || offset > out || out + length > capacity) return -1;
+        const unsigned char *match = dst + out - offset;
+        if(offset >= length) {
+            memcpy(dst + out, match, length);
+        } else {
+            // overlapping match repeats the last offset bytes
+            for(int i = 0; i < length; i++) dst[out + i] = match[i];
+        }
+        out += length;
+    }
+    return out;
+}
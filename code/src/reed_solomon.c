@@ -0,0 +1,247 @@
+// Reed-Solomon block code implementation
+// GF(256) with the primitive polynomial x^8 + x^4 + x^3 + x^2 + 1, generator roots alpha^0 to alpha^(parity - 1).
+// Codewords are stored highest degree first: data, then check bytes.
+
+#include "reed_solomon.h"
+
+#include <pthread.h>
+#include <string.h>
+
+unsigned char gfExp[2 * RS_CODEWORD];
+unsigned char gfLog[RS_CODEWORD + 1];
+pthread_once_t gfTablesOnce = PTHREAD_ONCE_INIT; // connections on several threads may build codes at once
+
+void gfBuildTables() {
+    int x = 1;
+    for(int i = 0; i < RS_CODEWORD; i++) {
+        gfExp[i] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if(x & 0x100) x ^= 0x11D;
+    }
+    for(int i = RS_CODEWORD; i < 2 * RS_CODEWORD; i++) gfExp[i] = gfExp[i - RS_CODEWORD];
+}
+
+unsigned char gfMul(unsigned char a, unsigned char b) {
+    if(a == 0 || b == 0) return 0;
+    return gfExp[gfLog[a] + gfLog[b]];
+}
+
+unsigned char gfDiv(unsigned char a, unsigned char b) {
+    if(a == 0) return 0;
+    return gfExp[gfLog[a] + RS_CODEWORD - gfLog[b]];
+}
+
+// alpha^power, for any power
+unsigned char gfPow(int power) {
+    power %= RS_CODEWORD;
+    if(power < 0) power += RS_CODEWORD;
+    return gfExp[power];
+}
+
+void rsBuildCode(RsCode *code, int strength) {
+    pthread_once(&gfTablesOnce, gfBuildTables);
+    code->parity = 2 * strength;
+
+    // g(x) = (x - alpha^0)(x - alpha^1)...(x - alpha^(parity - 1))
+    memset(code->generator, 0, sizeof(code->generator));
+    code->generator[0] = 1;
+    for(int i = 0; i < code->parity; i++) {
+        for(int j = i + 1; j > 0; j--) {
+            code->generator[j] ^= gfMul(code->generator[j - 1], gfExp[i]);
+        }
+    }
+}
+
+// Number of codewords a block of size bytes is spread over.
+int rsCodewords(const RsCode *code, int size) {
+    int room = RS_CODEWORD - code->parity;
+    return (size + room - 1) / room;
+}
+
+int rsParitySize(const RsCode *code, int size) {
+    return rsCodewords(code, size) * code->parity;
+}
+
+// Check bytes of one codeword: the remainder of data(x) * x^parity divided by g(x).
+void rsEncodeCodeword(const RsCode *code, const unsigned char *data, int size, unsigned char *parity) {
+    memset(parity, 0, code->parity);
+    for(int i = 0; i < size; i++) {
+        unsigned char feedback = data[i] ^ parity[0];
+        for(int j = 0; j < code->parity - 1; j++) {
+            parity[j] = parity[j + 1] ^ gfMul(feedback, code->generator[j + 1]);
+        }
+        parity[code->parity - 1] = gfMul(feedback, code->generator[code->parity]);
+    }
+}
+
+void rsEncode(const RsCode *code, const unsigned char *data, int size, unsigned char *parity) {
+    int n = rsCodewords(code, size);
+    unsigned char codeword[RS_CODEWORD];
+    for(int c = 0; c < n; c++) {
+        int length = 0;
+        for(int i = c; i < size; i += n) codeword[length++] = data[i];
+        rsEncodeCodeword(code, codeword, length, parity + c * code->parity);
+    }
+}
+
+// Corrects one codeword of size bytes in place (Berlekamp-Massey, Chien search and Forney).
+// Return the number of bytes fixed, or "-1" if there are too many errors.
+int rsDecodeCodeword(const RsCode *code, unsigned char *codeword, int size) {
+    unsigned char syndromes[2 * RS_MAX_STRENGTH];
+    int clean = 1;
+    for(int i = 0; i < code->parity; i++) {
+        unsigned char s = 0;
+        for(int k = 0; k < size; k++) s = gfMul(s, gfExp[i]) ^ codeword[k];
+        syndromes[i] = s;
+        if(s != 0) clean = 0;
+    }
+    if(clean) return 0;
+
+    // error locator, lowest degree first
+    unsigned char locator[2 * RS_MAX_STRENGTH + 1] = {1};
+    unsigned char previous[2 * RS_MAX_STRENGTH + 1] = {1};
+    int errors = 0;
+    int shift = 1;
+    unsigned char lastDiscrepancy = 1;
+
+    for(int n = 0; n < code->parity; n++) {
+        unsigned char discrepancy = syndromes[n];
+        for(int i = 1; i <= errors; i++) discrepancy ^= gfMul(locator[i], syndromes[n - i]);
+        if(discrepancy == 0) {
+            shift++;
+            continue;
+        }
+
+        unsigned char saved[2 * RS_MAX_STRENGTH + 1];
+        memcpy(saved, locator, sizeof(saved));
+        unsigned char scale = gfDiv(discrepancy, lastDiscrepancy);
+        for(int i = 0; i + shift <= code->parity; i++) {
+            locator[i + shift] ^= gfMul(scale, previous[i]);
+        }
+        if(2 * errors <= n) {
+            errors = n + 1 - errors;
+            memcpy(previous, saved, sizeof(previous));
+            lastDiscrepancy = discrepancy;
+            shift = 1;
+        } else {
+            shift++;
+        }
+    }
+    if(errors > code->parity / 2) return -1;
+
+    // evaluator: syndromes(x) * locator(x) mod x^parity
+    unsigned char evaluator[2 * RS_MAX_STRENGTH] = {0};
+    for(int i = 0; i < code->parity; i++) {
+        for(int j = 0; j <= i && j <= errors; j++) evaluator[i] ^= gfMul(syndromes[i - j], locator[j]);
+    }
+
+    // the byte at index k has degree size - 1 - k, it is wrong if locator(alpha^-degree) = 0
+    int found = 0;
+    for(int k = 0; k < size; k++) {
+        int degree = size - 1 - k;
+        unsigned char inverse = gfPow(-degree);
+
+        unsigned char value = 0;
+        for(int i = errors; i >= 0; i--) value = gfMul(value, inverse) ^ locator[i];
+        if(value != 0) continue;
+
+        // Forney: error = X * evaluator(X^-1) / locator'(X^-1), with X = alpha^degree
+        unsigned char numerator = 0;
+        for(int i = code->parity - 1; i >= 0; i--) numerator = gfMul(numerator, inverse) ^ evaluator[i];
+        unsigned char denominator = 0;
+        for(int i = errors - (errors % 2 == 0); i >= 1; i -= 2) {
+            denominator ^= gfMul(locator[i], gfPow(-degree * (i - 1)));
+        }
+        if(denominator == 0) return -1;
+        codeword[k] ^= gfMul(gfPow(degree), gfDiv(numerator, denominator));
+        found++;
+    }
+    return found == errors ? found : -1;
+}
+
+int rsDecode(const RsCode *code, unsigned char *block, int size, int *corrected) {
+    // size = data + n * parity with n = ceil(size / RS_CODEWORD), see rsEncode
+    int n = (size + RS_CODEWORD - 1) / RS_CODEWORD;
+    int dataSize = size - n * code->parity;
+    if(dataSize < 1 || rsCodewords(code, dataSize) != n) return -1;
+
+    unsigned char codeword[RS_CODEWORD];
+    for(int c = 0; c < n; c++) {
+        int length = 0;
+        for(int i = c; i < dataSize; i += n) codeword[length++] = block[i];
+        memcpy(codeword + length, block + dataSize + c * code->parity, code->parity);
+
+        int fixed = rsDecodeCodeword(code, codeword, length + code->parity);
+        if(fixed < 0) return -1;
+        if(fixed == 0) continue;
+
+        length = 0;
+        for(int i = c; i < dataSize; i += n) block[i] = codeword[length++];
+        memcpy(block + dataSize + c * code->parity, codeword + length, code->parity);
+        *corrected += fixed;
+    }
+    return dataSize;
+}
+
+unsigned char rsErasureCoefficient(int row, int index, int nData) {
+    pthread_once(&gfTablesOnce, gfBuildTables);
+    // 1 / (x_index + y_row) with x_index = index and y_row = nData + row, all distinct
+    return gfDiv(1, index ^ (nData + row));
+}
+
+void rsMulAdd(unsigned char *dst, const unsigned char *src, int size, unsigned char factor) {
+    if(factor == 0) return;
+    int logFactor = gfLog[factor];
+    for(int i = 0; i < size; i++) {
+        if(src[i] != 0) dst[i] ^= gfExp[gfLog[src[i]] + logFactor];
+    }
+}
+
+int rsSolveErasures(unsigned char **syndromes, const int *rows, const int *missing, int nMissing, int nData, int size,
+                    unsigned char **blocks) {
+    unsigned char matrix[RS_MAX_STRENGTH][RS_MAX_STRENGTH];
+    unsigned char inverse[RS_MAX_STRENGTH][RS_MAX_STRENGTH];
+    if(nMissing > RS_MAX_STRENGTH) return -1;
+
+    for(int a = 0; a < nMissing; a++) {
+        for(int b = 0; b < nMissing; b++) {
+            matrix[a][b] = rsErasureCoefficient(rows[a], missing[b], nData);
+            inverse[a][b] = a == b;
+        }
+    }
+
+    // Gauss-Jordan elimination
+    for(int col = 0; col < nMissing; col++) {
+        int pivot = col;
+        while(pivot < nMissing && matrix[pivot][col] == 0) pivot++;
+        if(pivot == nMissing) return -1;
+        for(int k = 0; k < nMissing; k++) {
+            unsigned char swap = matrix[col][k];
+            matrix[col][k] = matrix[pivot][k];
+            matrix[pivot][k] = swap;
+            swap = inverse[col][k];
+            inverse[col][k] = inverse[pivot][k];
+            inverse[pivot][k] = swap;
+        }
+        unsigned char scale = gfDiv(1, matrix[col][col]);
+        for(int k = 0; k < nMissing; k++) {
+            matrix[col][k] = gfMul(matrix[col][k], scale);
+            inverse[col][k] = gfMul(inverse[col][k], scale);
+        }
+        for(int r = 0; r < nMissing; r++) {
+            unsigned char factor = matrix[r][col];
+            if(r == col || factor == 0) continue;
+            for(int k = 0; k < nMissing; k++) {
+                matrix[r][k] ^= gfMul(factor, matrix[col][k]);
+                inverse[r][k] ^= gfMul(factor, inverse[col][k]);
+            }
+        }
+    }
+
+    for(int b = 0; b < nMissing; b++) {
+        memset(blocks[b], 0, size);
+        for(int a = 0; a < nMissing; a++) rsMulAdd(blocks[b], syndromes[a], size, inverse[b][a]);
+    }
+    return 0;
+}
@@ -0,0 +1,103 @@
+// Lock-free single-producer/single-consumer ring implementation
+
+#include "spsc_ring.h"
+
+#include <sched.h>
+#include <stdlib.h>
+
+int ringSpin(int *attempt, int limit) {
+    if(*attempt >= limit) return 0;
+    if(*attempt >= limit / 2) sched_yield();
+    (*attempt)++;
+    return 1;
+}
+
+int ringInit(SpscRing *ring, unsigned int capacity, int slotSize) {
+    unsigned int size = 1;
+    while(size < capacity) size <<= 1;
+    ring->slots = malloc((size_t)size * slotSize);
+    if(ring->slots == NULL) return -1;
+    ring->slotSize = slotSize;
+    ring->capacity = size;
+    ring->spins = RING_SPINS;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, 0);
+    atomic_init(&ring->parked, 0);
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->wake, NULL);
+    return 0;
+}
+
+void ringFree(SpscRing *ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->wake);
+}
+
+// Wakes the other end if it parked. Its count goes up before it looks at the ring again, and this end changed the
+// ring before looking at the count, so one of the two always sees the other.
+void ringWake(SpscRing *ring) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&ring->parked, memory_order_relaxed) == 0) return;
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_broadcast(&ring->wake);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// Whether the producer has no free slot, or the consumer no filled one, to go on with.
+int ringBlocked(SpscRing *ring, int producer) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if(atomic_load_explicit(&ring->closed, memory_order_acquire)) return 0;
+    return producer ? tail - head == ring->capacity : tail == head;
+}
+
+// Sleeps until the other end moves or the ring is closed.
+void ringPark(SpscRing *ring, int producer) {
+    pthread_mutex_lock(&ring->lock);
+    atomic_fetch_add_explicit(&ring->parked, 1, memory_order_seq_cst);
+    atomic_thread_fence(memory_order_seq_cst);
+    while(ringBlocked(ring, producer)) pthread_cond_wait(&ring->wake, &ring->lock);
+    atomic_fetch_sub_explicit(&ring->parked, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void *ringProducerSlot(SpscRing *ring) {
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    int attempt = 0;
+    while(tail - atomic_load_explicit(&ring->head, memory_order_acquire) == ring->capacity) {
+        if(atomic_load_explicit(&ring->closed, memory_order_acquire)) return NULL;
+        if(!ringSpin(&attempt, ring->spins)) ringPark(ring, 1);
+    }
+    if(atomic_load_explicit(&ring->closed, memory_order_acquire)) return NULL;
+    return ring->slots + (size_t)(tail & (ring->capacity - 1)) * ring->slotSize;
+}
+
+void ringPublish(SpscRing *ring) {
+    atomic_fetch_add_explicit(&ring->tail, 1, memory_order_release);
+    ringWake(ring);
+}
+
+void *ringConsumerSlot(SpscRing *ring) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    int attempt = 0;
+    while(atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+        // re-check after seeing closed, the last slots may have been published just before
+        if(atomic_load_explicit(&ring->closed, memory_order_acquire) &&
+           atomic_load_explicit(&ring->tail, memory_order_acquire) == head) return NULL;
+        if(!ringSpin(&attempt, ring->spins)) ringPark(ring, 0);
+    }
+    return ring->slots + (size_t)(head & (ring->capacity - 1)) * ring->slotSize;
+}
+
+void ringRelease(SpscRing *ring) {
+    atomic_fetch_add_explicit(&ring->head, 1, memory_order_release);
+    ringWake(ring);
+}
+
+void ringClose(SpscRing *ring) {
+    atomic_store_explicit(&ring->closed, 1, memory_order_release);
+    ringWake(ring);
+}
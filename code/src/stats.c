@@ -0,0 +1,156 @@
+// Transfer statistics implementation
+
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Link objects waiting for statsWriteReport, closed links may come from different threads.
+char **reportedLinks = NULL;
+int nReportedLinks = 0;
+pthread_mutex_t reportLock = PTHREAD_MUTEX_INITIALIZER;
+
+long long statsNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Values below 2^(HISTOGRAM_SUB_BITS + 1) get a bucket each, every power of two above is split in
+// 2^HISTOGRAM_SUB_BITS buckets.
+int histogramBucket(long long value) {
+    if(value < (2 << HISTOGRAM_SUB_BITS)) return value;
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    int bucket = (shift << HISTOGRAM_SUB_BITS) + (value >> shift);
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+// Smallest value of a bucket.
+long long histogramLowest(int bucket) {
+    if(bucket < (2 << HISTOGRAM_SUB_BITS)) return bucket;
+    int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    return (long long)(bucket - (shift << HISTOGRAM_SUB_BITS)) << shift;
+}
+
+// Largest value of a bucket.
+long long histogramHighest(int bucket) {
+    return bucket + 1 < HISTOGRAM_BUCKETS ? histogramLowest(bucket + 1) - 1 : histogramLowest(bucket);
+}
+
+void histogramRecord(Histogram *histogram, long long value) {
+    if(value < 0) value = 0;
+    histogram->counts[histogramBucket(value)]++;
+    if(histogram->count == 0 || value < histogram->min) histogram->min = value;
+    if(value > histogram->max) histogram->max = value;
+    histogram->count++;
+    histogram->sum += value;
+}
+
+long long histogramPercentile(const Histogram *histogram, double percentile) {
+    if(histogram->count == 0) return 0;
+    long rank = (long)(percentile / 100 * histogram->count + 0.5);
+    if(rank < 1) rank = 1;
+    long seen = 0;
+    for(int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += histogram->counts[bucket];
+        if(seen >= rank) {
+            long long value = histogramHighest(bucket);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+void histogramJson(FILE *out, const Histogram *histogram) {
+    fprintf(out, "{\"count\": %ld, \"min\": %lld, \"mean\": %.1f, \"max\": %lld",
+            histogram->count, histogram->min, histogram->count > 0 ? (double)histogram->sum / histogram->count : 0,
+            histogram->max);
+    fprintf(out, ", \"p50\": %lld, \"p90\": %lld, \"p99\": %lld, \"p99.9\": %lld",
+            histogramPercentile(histogram, 50), histogramPercentile(histogram, 90),
+            histogramPercentile(histogram, 99), histogramPercentile(histogram, 99.9));
+    // [lowest value, count] of each bucket in use
+    fprintf(out, ", \"buckets\": [");
+    const char *separator = "";
+    for(int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        if(histogram->counts[bucket] == 0) continue;
+        fprintf(out, "%s[%lld, %ld]", separator, histogramLowest(bucket), histogram->counts[bucket]);
+        separator = ", ";
+    }
+    fprintf(out, "]}");
+}
+
+void goodputInit(GoodputSeries *series, long long start) {
+    memset(series, 0, sizeof(GoodputSeries));
+    series->start = start;
+    series->interval = GOODPUT_INTERVAL;
+}
+
+void goodputRecord(GoodputSeries *series, long long now, long bytes) {
+    long long slot = (now - series->start) / series->interval;
+    if(slot < 0) slot = 0;
+    // out of slots: pairs are merged into slots twice as wide
+    while(slot >= GOODPUT_SLOTS) {
+        for(int i = 0; i < GOODPUT_SLOTS / 2; i++) {
+            series->bytes[i] = series->bytes[2 * i] + series->bytes[2 * i + 1];
+        }
+        memset(series->bytes + GOODPUT_SLOTS / 2, 0, GOODPUT_SLOTS / 2 * sizeof(long));
+        series->used = (series->used + 1) / 2;
+        series->interval *= 2;
+        slot = (now - series->start) / series->interval;
+    }
+    series->bytes[slot] += bytes;
+    if(slot + 1 > series->used) series->used = slot + 1;
+}
+
+void goodputJson(FILE *out, const GoodputSeries *series) {
+    double seconds = series->interval / 1e6;
+    fprintf(out, "{\"interval_s\": %g, \"bytes_per_s\": [", seconds);
+    for(int i = 0; i < series->used; i++) {
+        fprintf(out, "%s%.0f", i > 0 ? ", " : "", series->bytes[i] / seconds);
+    }
+    fprintf(out, "]}");
+}
+
+void statsInit(LinkStats *stats) {
+    memset(stats, 0, sizeof(LinkStats));
+    stats->openedAt = statsNow();
+    goodputInit(&stats->goodput, stats->openedAt);
+}
+
+void statsReportLink(char *json) {
+    pthread_mutex_lock(&reportLock);
+    char **links = realloc(reportedLinks, (nReportedLinks + 1) * sizeof(char *));
+    if(links == NULL) {
+        free(json);
+    } else {
+        reportedLinks = links;
+        reportedLinks[nReportedLinks++] = json;
+    }
+    pthread_mutex_unlock(&reportLock);
+}
+
+int statsWriteReport(const char *path, const char *role, long bytes, double seconds) {
+    pthread_mutex_lock(&reportLock);
+    FILE *out = fopen(path, "w");
+    if(out != NULL) {
+        fprintf(out, "{\n  \"role\": \"%s\",\n", role);
+        fprintf(out, "  \"transfer\": {\"bytes\": %ld, \"elapsed_s\": %.6f, \"bitrate_bps\": %.0f},\n", bytes, seconds,
+                seconds > 0 ? bytes * 8 / seconds : 0);
+        fprintf(out, "  \"links\": [");
+        for(int i = 0; i < nReportedLinks; i++) fprintf(out, "%s\n    %s", i > 0 ? "," : "", reportedLinks[i]);
+        fprintf(out, "\n  ]\n}\n");
+    }
+    for(int i = 0; i < nReportedLinks; i++) free(reportedLinks[i]);
+    free(reportedLinks);
+    reportedLinks = NULL;
+    nReportedLinks = 0;
+    pthread_mutex_unlock(&reportLock);
+
+    if(out == NULL || fclose(out) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
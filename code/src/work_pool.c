@@ -0,0 +1,153 @@
+// Ordered worker pool implementation
+
+#include "work_pool.h"
+#include "spsc_ring.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_POOL_THREADS 16
+
+// Whether worker job index has no slot yet.
+int poolSlotTaken(WorkPool *pool, long index) {
+    return !atomic_load_explicit(&pool->closed, memory_order_acquire) &&
+           index - atomic_load_explicit(&pool->consumed, memory_order_acquire) >= pool->capacity;
+}
+
+// Whether the result of job index is not in its slot yet.
+int poolResultPending(WorkPool *pool, long index) {
+    return !atomic_load_explicit(&pool->closed, memory_order_acquire) &&
+           atomic_load_explicit(&pool->done[index & (pool->capacity - 1)], memory_order_acquire) != index + 1;
+}
+
+// Wakes the threads asleep on cond, if parked says there are any. The sleepers count themselves before they look
+// at the pool again and the caller changed the pool before looking at the count, so one of the two sees the other.
+void poolWake(WorkPool *pool, atomic_int *parked, pthread_cond_t *cond) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(parked, memory_order_relaxed) == 0) return;
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void *poolWorker(void *arg) {
+    WorkPool *pool = arg;
+
+    while(!atomic_load_explicit(&pool->closed, memory_order_acquire)) {
+        long index = atomic_fetch_add_explicit(&pool->next, 1, memory_order_relaxed);
+        if(index >= pool->nJobs) break;
+
+        // the slot is free once the consumer released the job capacity places before, workers run ahead of the
+        // line by design so most of their time goes here, asleep
+        int attempt = 0;
+        while(poolSlotTaken(pool, index)) {
+            if(ringSpin(&attempt, RING_SPINS)) continue;
+            pthread_mutex_lock(&pool->lock);
+            atomic_fetch_add_explicit(&pool->parkedWorkers, 1, memory_order_seq_cst);
+            atomic_thread_fence(memory_order_seq_cst);
+            while(poolSlotTaken(pool, index)) pthread_cond_wait(&pool->freed, &pool->lock);
+            atomic_fetch_sub_explicit(&pool->parkedWorkers, 1, memory_order_relaxed);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        if(atomic_load_explicit(&pool->closed, memory_order_acquire)) return NULL;
+
+        unsigned int slot = index & (pool->capacity - 1);
+        pool->job(pool->context, index, pool->slots + (size_t)slot * pool->slotSize);
+        atomic_store_explicit(&pool->done[slot], index + 1, memory_order_release);
+        poolWake(pool, &pool->parkedConsumer, &pool->ready);
+    }
+    return NULL;
+}
+
+int poolStart(WorkPool *pool, int nThreads, unsigned int capacity, int slotSize, long nJobs, PoolJob job,
+              void *context) {
+    unsigned int size = 1;
+    while(size < capacity) size <<= 1;
+
+    pool->slots = malloc((size_t)size * slotSize);
+    pool->done = malloc(size * sizeof(atomic_long));
+    pool->threads = malloc(nThreads * sizeof(pthread_t));
+    if(pool->slots == NULL || pool->done == NULL || pool->threads == NULL) {
+        free(pool->slots);
+        free(pool->done);
+        free(pool->threads);
+        return -1;
+    }
+
+    pool->slotSize = slotSize;
+    pool->capacity = size;
+    pool->nJobs = nJobs;
+    pool->job = job;
+    pool->context = context;
+    atomic_init(&pool->next, 0);
+    atomic_init(&pool->consumed, 0);
+    atomic_init(&pool->closed, 0);
+    atomic_init(&pool->parkedWorkers, 0);
+    atomic_init(&pool->parkedConsumer, 0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->freed, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    for(unsigned int i = 0; i < size; i++) atomic_init(&pool->done[i], 0);
+
+    pool->nThreads = 0;
+    while(pool->nThreads < nThreads &&
+          pthread_create(&pool->threads[pool->nThreads], NULL, poolWorker, pool) == 0) {
+        pool->nThreads++;
+    }
+    if(pool->nThreads == 0) {
+        poolStop(pool);
+        return -1;
+    }
+    return 0;
+}
+
+void *poolResult(WorkPool *pool) {
+    long index = atomic_load_explicit(&pool->consumed, memory_order_relaxed);
+    if(index >= pool->nJobs) return NULL;
+
+    unsigned int slot = index & (pool->capacity - 1);
+    int attempt = 0;
+    while(poolResultPending(pool, index)) {
+        if(ringSpin(&attempt, RING_SPINS)) continue;
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add_explicit(&pool->parkedConsumer, 1, memory_order_seq_cst);
+        atomic_thread_fence(memory_order_seq_cst);
+        while(poolResultPending(pool, index)) pthread_cond_wait(&pool->ready, &pool->lock);
+        atomic_fetch_sub_explicit(&pool->parkedConsumer, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if(atomic_load_explicit(&pool->done[slot], memory_order_acquire) != index + 1) return NULL;
+    return pool->slots + (size_t)slot * pool->slotSize;
+}
+
+void poolRelease(WorkPool *pool) {
+    atomic_fetch_add_explicit(&pool->consumed, 1, memory_order_release);
+    poolWake(pool, &pool->parkedWorkers, &pool->freed);
+}
+
+void poolStop(WorkPool *pool) {
+    atomic_store_explicit(&pool->closed, 1, memory_order_release);
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->freed);
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    for(int i = 0; i < pool->nThreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->freed);
+    pthread_cond_destroy(&pool->ready);
+    free(pool->slots);
+    free(pool->done);
+    free(pool->threads);
+    pool->slots = NULL;
+    pool->done = NULL;
+    pool->threads = NULL;
+}
+
+int poolDefaultThreads() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cores < 1) return 1;
+    if(cores > MAX_POOL_THREADS) return MAX_POOL_THREADS;
+    return cores;
+}